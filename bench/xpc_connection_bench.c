@@ -0,0 +1,188 @@
+// Loopback round-trip benchmark for the connection layer.
+//
+//   cc -O2 -Iinclude src/*.c bench/xpc_connection_bench.c -o xpc_connection_bench -lpthread -lm
+//   ./xpc_connection_bench [requests per client] [requests in flight per client]
+#include <xpc/xpc.h>
+#include <xpc/xpc_connection.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench_client {
+    xpc_connection_t conn;
+    size_t requests, depth;
+    uint64_t *latencies;
+    size_t done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t in_flight;
+};
+
+struct bench_request {
+    struct bench_client *client;
+    uint64_t start;
+};
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static xpc_object_t bench_echo(void *ctx, xpc_connection_t peer, xpc_object_t message) {
+    xpc_object_t reply = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_int64(reply, "seq", xpc_dictionary_get_int64(message, "seq"));
+    xpc_dictionary_set_string(reply, "status", "ok");
+    return reply;
+}
+
+static xpc_object_t bench_make_request(int64_t seq) {
+    xpc_object_t msg = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_int64(msg, "seq", seq);
+    xpc_dictionary_set_string(msg, "method", "com.example.echo");
+    xpc_dictionary_set_string(msg, "payload", "the quick brown fox jumps over the lazy dog");
+    return msg;
+}
+
+static void bench_on_reply(void *ctx, xpc_object_t reply) {
+    struct bench_request *req = (struct bench_request *) ctx;
+    struct bench_client *client = req->client;
+    uint64_t latency = bench_now() - req->start;
+    xpc_free(reply);
+    free(req);
+    pthread_mutex_lock(&client->lock);
+    client->latencies[client->done++] = latency;
+    --client->in_flight;
+    pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+}
+
+static void *bench_client_main(void *arg) {
+    struct bench_client *client = (struct bench_client *) arg;
+    struct bench_request *req;
+    xpc_object_t msg, reply;
+    uint64_t start;
+    size_t i;
+    for (i = 0; i < client->requests; i++) {
+        msg = bench_make_request((int64_t) i);
+        if (client->depth <= 1) {
+            start = bench_now();
+            reply = xpc_connection_send_message_with_reply_sync(client->conn, msg);
+            if (!reply) {
+                perror("xpc_connection_send_message_with_reply_sync");
+                xpc_free(msg);
+                break;
+            }
+            client->latencies[client->done++] = bench_now() - start;
+            xpc_free(reply);
+        } else {
+            pthread_mutex_lock(&client->lock);
+            while (client->in_flight >= client->depth)
+                pthread_cond_wait(&client->cond, &client->lock);
+            ++client->in_flight;
+            pthread_mutex_unlock(&client->lock);
+            req = malloc(sizeof(struct bench_request));
+            req->client = client;
+            req->start = bench_now();
+            if (xpc_connection_send_message_with_reply(client->conn, msg, bench_on_reply, req) < 0) {
+                perror("xpc_connection_send_message_with_reply");
+                free(req);
+                pthread_mutex_lock(&client->lock);
+                --client->in_flight;
+                pthread_mutex_unlock(&client->lock);
+                xpc_free(msg);
+                break;
+            }
+        }
+        xpc_free(msg);
+    }
+    pthread_mutex_lock(&client->lock);
+    while (client->in_flight > 0)
+        pthread_cond_wait(&client->cond, &client->lock);
+    pthread_mutex_unlock(&client->lock);
+    return NULL;
+}
+
+static int bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(uint64_t *sorted, size_t n, double p) {
+    return n > 0 ? sorted[(size_t) (p * (n - 1))] / 1000.0 : 0.0;
+}
+
+int main(int argc, char **argv) {
+    static const size_t client_counts[] = {1, 2, 4, 8, 16, 32, 64};
+    size_t requests = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    size_t depth = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    char path[64];
+    xpc_dispatch_t server_dispatch, client_dispatch;
+    xpc_listener_t listener;
+    struct bench_client *clients;
+    pthread_t *threads;
+    uint64_t *all, start, elapsed;
+    size_t c, i, nclients, total;
+
+    snprintf(path, sizeof(path), "/tmp/xpc_bench_%d.sock", (int) getpid());
+    server_dispatch = xpc_dispatch_create(ncpu > 1 ? (unsigned int) ncpu / 2 : 1);
+    client_dispatch = xpc_dispatch_create(ncpu > 1 ? (unsigned int) ncpu / 2 : 1);
+    listener = xpc_listener_create(server_dispatch, path, bench_echo, NULL);
+    if (!listener) {
+        perror("xpc_listener_create");
+        return 1;
+    }
+
+    printf("%zu requests per client, %zu in flight per client\n", requests, depth);
+    printf("%8s %12s %10s %10s %10s %10s\n", "clients", "msgs/s", "p50 us", "p90 us", "p99 us", "p99.9 us");
+    for (c = 0; c < sizeof(client_counts) / sizeof(client_counts[0]); c++) {
+        nclients = client_counts[c];
+        clients = calloc(nclients, sizeof(struct bench_client));
+        threads = calloc(nclients, sizeof(pthread_t));
+        for (i = 0; i < nclients; i++) {
+            clients[i].conn = xpc_connection_create(client_dispatch, path);
+            if (!clients[i].conn) {
+                perror("xpc_connection_create");
+                return 1;
+            }
+            clients[i].requests = requests;
+            clients[i].depth = depth;
+            clients[i].latencies = malloc(requests * sizeof(uint64_t));
+            pthread_mutex_init(&clients[i].lock, NULL);
+            pthread_cond_init(&clients[i].cond, NULL);
+        }
+        start = bench_now();
+        for (i = 0; i < nclients; i++)
+            pthread_create(&threads[i], NULL, bench_client_main, &clients[i]);
+        for (i = 0; i < nclients; i++)
+            pthread_join(threads[i], NULL);
+        elapsed = bench_now() - start;
+
+        total = 0;
+        all = malloc(nclients * requests * sizeof(uint64_t));
+        for (i = 0; i < nclients; i++) {
+            memcpy(&all[total], clients[i].latencies, clients[i].done * sizeof(uint64_t));
+            total += clients[i].done;
+            xpc_connection_free(clients[i].conn);
+            free(clients[i].latencies);
+            pthread_mutex_destroy(&clients[i].lock);
+            pthread_cond_destroy(&clients[i].cond);
+        }
+        qsort(all, total, sizeof(uint64_t), bench_compare);
+        printf("%8zu %12.0f %10.1f %10.1f %10.1f %10.1f\n", nclients, total / (elapsed / 1e9),
+               bench_percentile(all, total, 0.5), bench_percentile(all, total, 0.9),
+               bench_percentile(all, total, 0.99), bench_percentile(all, total, 0.999));
+        free(all);
+        free(threads);
+        free(clients);
+    }
+
+    xpc_listener_free(listener);
+    xpc_dispatch_free(client_dispatch);
+    xpc_dispatch_free(server_dispatch);
+    return 0;
+}
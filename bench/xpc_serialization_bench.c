@@ -0,0 +1,104 @@
+// Parallel serialization throughput of a large array of small dictionaries (about 420 MB by default).
+//
+//   cc -O2 -Iinclude src/*.c bench/xpc_serialization_bench.c -o xpc_serialization_bench -lpthread -lm
+//   ./xpc_serialization_bench [elements] [max threads] [repetitions]
+//
+// Runs 1, 2, 4, ... threads and then max threads itself, which defaults to the CPU count (at least 2, so the parallel
+// path always runs).
+#include <xpc/xpc.h>
+#include <xpc/xpc_serialization.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static xpc_object_t bench_make_element(int64_t seq) {
+    char name[32];
+    uint8_t payload[256];
+    xpc_object_t tags = xpc_array_create(NULL, 0);
+    xpc_object_t ret = xpc_dictionary_create(NULL, NULL, 0);
+    snprintf(name, sizeof(name), "element-%lld", (long long) seq);
+    memset(payload, (int) (seq & 0xff), sizeof(payload));
+    xpc_array_append_value(tags, xpc_string_create("bench"));
+    xpc_array_append_value(tags, xpc_uint64_create((uint64_t) seq * 2654435761u));
+    xpc_dictionary_set_int64(ret, "seq", seq);
+    xpc_dictionary_set_string(ret, "name", name);
+    xpc_dictionary_set_double(ret, "score", seq / 7.0);
+    xpc_dictionary_set_bool(ret, "even", (seq & 1) == 0);
+    xpc_dictionary_set_value(ret, "tags", tags);
+    xpc_dictionary_set_data(ret, "payload", payload, sizeof(payload));
+    return ret;
+}
+
+static unsigned int bench_next_threads(unsigned int nthreads, unsigned int max_threads) {
+    if (nthreads < max_threads)
+        return nthreads * 2 < max_threads ? nthreads * 2 : max_threads;
+    return max_threads + 1;
+}
+
+int main(int argc, char **argv) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    unsigned int max_threads = argc > 2 ? (unsigned int) strtoul(argv[2], NULL, 10) : (ncpu > 2 ? ncpu : 2);
+    size_t reps = argc > 3 ? strtoul(argv[3], NULL, 10) : 3;
+    xpc_object_t arr, obj;
+    uint8_t *expected, *buf;
+    size_t i, r, len, ret;
+    unsigned int nthreads;
+    uint64_t start, ser_best, de_best, ser_base = 0, de_base = 0;
+
+    arr = xpc_array_create_preallocated(count);
+    for (i = 0; i < count; i++)
+        xpc_array_append_value(arr, bench_make_element((int64_t) i));
+    len = xpc_serialized_size(arr);
+    expected = malloc(len);
+    buf = malloc(len);
+    xpc_serialize(arr, expected);
+
+    printf("%zu elements, %.1f MB serialized, best of %zu\n", count, len / 1e6, reps);
+    printf("%8s %12s %10s %12s %10s\n", "threads", "ser MB/s", "speedup", "deser MB/s", "speedup");
+    for (nthreads = 1; nthreads <= max_threads; nthreads = bench_next_threads(nthreads, max_threads)) {
+        ser_best = de_best = UINT64_MAX;
+        for (r = 0; r < reps; r++) {
+            memset(buf, 0, len);
+            start = bench_now();
+            ret = xpc_serialize_parallel(arr, buf, nthreads);
+            start = bench_now() - start;
+            if (start < ser_best)
+                ser_best = start;
+            if (ret != len || memcmp(buf, expected, len) != 0) {
+                fprintf(stderr, "%u threads: output differs from xpc_serialize\n", nthreads);
+                return 1;
+            }
+
+            start = bench_now();
+            obj = xpc_deserialize_parallel(buf, len, nthreads);
+            start = bench_now() - start;
+            if (start < de_best)
+                de_best = start;
+            if (!obj || !xpc_equal(obj, arr)) {
+                fprintf(stderr, "%u threads: deserialized object differs\n", nthreads);
+                return 1;
+            }
+            xpc_free(obj);
+        }
+        if (nthreads == 1) {
+            ser_base = ser_best;
+            de_base = de_best;
+        }
+        printf("%8u %12.1f %9.2fx %12.1f %9.2fx\n", nthreads, len / (ser_best / 1e3), (double) ser_base / ser_best,
+               len / (de_best / 1e3), (double) de_base / de_best);
+    }
+
+    free(buf);
+    free(expected);
+    xpc_free(arr);
+    return 0;
+}
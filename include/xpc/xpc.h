@@ -24,6 +24,15 @@ enum xpc_value_type {
 };
 typedef enum xpc_value_type xpc_type_t;
 
+// Must be set before any object is created, as objects are released through whichever allocator is current
+struct xpc_allocator {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+};
+void xpc_set_allocator(const struct xpc_allocator *allocator);
+
 void xpc_free(xpc_object_t obj);
 
 xpc_type_t xpc_get_type(xpc_object_t obj);
@@ -50,6 +59,18 @@ const unsigned char *xpc_uuid_get_bytes(xpc_object_t obj);
 xpc_object_t xpc_dictionary_create(const char **keys, const xpc_object_t *values, size_t count);
 xpc_object_t xpc_dictionary_get_value(xpc_object_t obj, const char *key);
 void xpc_dictionary_set_value(xpc_object_t obj, const char *key, xpc_object_t value);
+size_t xpc_dictionary_get_count(xpc_object_t obj);
+
+// Iteration visits entries in insertion order. Entries may be removed while iterating, but not added.
+typedef bool (*xpc_dictionary_applier_f)(void *ctx, const char *key, xpc_object_t value);
+bool xpc_dictionary_apply_f(xpc_object_t obj, void *ctx, xpc_dictionary_applier_f applier);
+
+typedef struct {
+    xpc_object_t dict;
+    size_t pos;
+} xpc_dictionary_iter_t;
+void xpc_dictionary_iter_init(xpc_dictionary_iter_t *it, xpc_object_t obj);
+bool xpc_dictionary_iter_next(xpc_dictionary_iter_t *it, const char **key, xpc_object_t *value);
 
 bool xpc_dictionary_get_bool(xpc_object_t obj, const char *key);
 int64_t xpc_dictionary_get_int64(xpc_object_t obj, const char *key);
@@ -70,5 +91,21 @@ xpc_object_t xpc_array_create_preallocated(size_t mem_count);
 void xpc_array_append_value(xpc_object_t obj, xpc_object_t value);
 void xpc_array_set_value(xpc_object_t obj, size_t index, xpc_object_t value);
 xpc_object_t xpc_array_get_value(xpc_object_t obj, size_t index);
+size_t xpc_array_get_count(xpc_object_t obj);
+
+typedef bool (*xpc_array_applier_f)(void *ctx, size_t index, xpc_object_t value);
+bool xpc_array_apply_f(xpc_object_t obj, void *ctx, xpc_array_applier_f applier);
+
+bool xpc_equal(xpc_object_t a, xpc_object_t b);
+uint64_t xpc_hash(xpc_object_t obj);
+
+// The cache takes ownership of the object passed to xpc_intern and returns a shared canonical instance. Interned
+// objects are immutable, xpc_free on them is a no-op and they stay valid until the cache is freed.
+typedef struct xpc_intern_cache *xpc_intern_cache_t;
+
+xpc_intern_cache_t xpc_intern_cache_create(void);
+void xpc_intern_cache_free(xpc_intern_cache_t cache);
+size_t xpc_intern_cache_get_count(xpc_intern_cache_t cache);
+xpc_object_t xpc_intern(xpc_intern_cache_t cache, xpc_object_t obj);
 
 #endif //XPC_H
@@ -0,0 +1,26 @@
+#ifndef XPC_ARCHIVE_H
+#define XPC_ARCHIVE_H
+
+#include "xpc.h"
+
+typedef struct xpc_archive *xpc_archive_t;
+
+// Opens the archive for appending, creating it if needed. Only one writer may have an archive open at a time, while
+// any number of readers can open it concurrently.
+#define XPC_ARCHIVE_WRITE 1
+
+// A handle must not be shared between threads, open one per thread instead
+xpc_archive_t xpc_archive_open(const char *path, int flags);
+void xpc_archive_close(xpc_archive_t archive);
+
+// Storing an existing key replaces its record. They return -1 and set errno on failure.
+int xpc_archive_put(xpc_archive_t archive, const char *key, xpc_object_t obj);
+int xpc_archive_put_bytes(xpc_archive_t archive, const char *key, const uint8_t *buf, size_t len);
+int xpc_archive_sync(xpc_archive_t archive);
+
+size_t xpc_archive_get_count(xpc_archive_t archive);
+xpc_object_t xpc_archive_get(xpc_archive_t archive, const char *key);
+// Returns the serialized record straight from the mapping, valid until the next call on the same handle
+const uint8_t *xpc_archive_get_bytes(xpc_archive_t archive, const char *key, size_t *len);
+
+#endif //XPC_ARCHIVE_H
@@ -0,0 +1,46 @@
+#ifndef XPC_CONNECTION_H
+#define XPC_CONNECTION_H
+
+#include "xpc.h"
+
+typedef struct xpc_dispatch *xpc_dispatch_t;
+typedef struct xpc_listener *xpc_listener_t;
+typedef struct xpc_connection *xpc_connection_t;
+
+// Runs on a dispatch thread. The message is freed once the handler returns; the returned reply (or an empty
+// dictionary if NULL is returned) is sent back if the peer asked for one, and freed either way. The peer is only
+// valid until the handler returns unless it is retained.
+typedef xpc_object_t (*xpc_connection_handler_f)(void *ctx, xpc_connection_t peer, xpc_object_t message);
+// Runs on a dispatch thread and takes ownership of the reply. The reply is NULL if the connection closed first.
+typedef void (*xpc_connection_reply_handler_f)(void *ctx, xpc_object_t reply);
+// Runs on a dispatch thread once a listener's peer has closed, sends to it fail with ENOTCONN from then on
+typedef void (*xpc_connection_close_handler_f)(void *ctx, xpc_connection_t peer);
+
+// Every listener and connection has to be freed before the dispatch it was created on. Create returns NULL and sets
+// errno if a thread or its descriptors can't be set up.
+xpc_dispatch_t xpc_dispatch_create(unsigned int nthreads);
+void xpc_dispatch_free(xpc_dispatch_t dispatch);
+
+// The socket file is created here and removed again by xpc_listener_free
+xpc_listener_t xpc_listener_create(xpc_dispatch_t dispatch, const char *path, xpc_connection_handler_f handler,
+                                   void *ctx);
+void xpc_listener_free(xpc_listener_t listener);
+
+xpc_connection_t xpc_connection_create(xpc_dispatch_t dispatch, const char *path);
+void xpc_connection_free(xpc_connection_t conn);
+
+// Keep a listener's peer around past the handler, e.g. to send to it later or from another thread. Every retain
+// needs a release. A retained peer may outlive its listener, sends to it fail with ENOTCONN once it has closed.
+void xpc_connection_retain(xpc_connection_t peer);
+void xpc_connection_release(xpc_connection_t peer);
+// Returns -1 and sets errno to ENOTCONN if the peer has already closed
+int xpc_connection_set_close_handler(xpc_connection_t peer, xpc_connection_close_handler_f handler, void *ctx);
+
+// Messages are serialized before these return, so the caller keeps ownership. They return -1 and set errno on failure.
+int xpc_connection_send_message(xpc_connection_t conn, xpc_object_t message);
+int xpc_connection_send_message_with_reply(xpc_connection_t conn, xpc_object_t message,
+                                           xpc_connection_reply_handler_f handler, void *ctx);
+// Must not be called from a dispatch thread of the same dispatch
+xpc_object_t xpc_connection_send_message_with_reply_sync(xpc_connection_t conn, xpc_object_t message);
+
+#endif //XPC_CONNECTION_H
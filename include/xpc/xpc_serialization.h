@@ -5,7 +5,17 @@
 
 size_t xpc_serialized_size(xpc_object_t o);
 size_t xpc_serialize(xpc_object_t o, uint8_t *buf);
+// Writes dictionary keys in sorted order, so equal objects always serialize to the same bytes
+size_t xpc_serialize_canonical(xpc_object_t o, uint8_t *buf);
+// Splits a large top level array or dictionary between up to nthreads threads, the caller included. The output is
+// byte-identical to xpc_serialize; small objects are serialized on the calling thread.
+size_t xpc_serialize_parallel(xpc_object_t o, uint8_t *buf, unsigned int nthreads);
 
 xpc_object_t xpc_deserialize(const uint8_t *buf, size_t len);
+// Custom allocators have to be thread-safe to use the parallel variants
+xpc_object_t xpc_deserialize_parallel(const uint8_t *buf, size_t len, unsigned int nthreads);
+
+// Computes the same hash as xpc_hash on the deserialized object. Returns false if buf isn't a serialized message.
+bool xpc_hash_serialized(const uint8_t *buf, size_t len, uint64_t *hash);
 
 #endif //XPC_SERIALIZATION_H
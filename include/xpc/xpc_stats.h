@@ -0,0 +1,32 @@
+#ifndef XPC_STATS_H
+#define XPC_STATS_H
+
+#include "xpc.h"
+
+// Counters are only collected when the library is compiled with XPC_ENABLE_STATS defined
+
+#define XPC_STATS_MAX_TYPE 16
+#define XPC_STATS_HISTOGRAM_SIZE 32
+#define XPC_STATS_PROBE_HISTOGRAM_SIZE 16
+
+struct xpc_stats_type {
+    uint64_t live_count, total_count;
+    uint64_t live_bytes, total_bytes;
+};
+
+// Histogram bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeroes
+struct xpc_stats_op {
+    uint64_t count, bytes, time_ns;
+    uint64_t size_histogram[XPC_STATS_HISTOGRAM_SIZE];
+    uint64_t time_histogram[XPC_STATS_HISTOGRAM_SIZE];
+};
+
+struct xpc_stats {
+    struct xpc_stats_type types[XPC_STATS_MAX_TYPE]; // indexed by xpc_type_t
+    struct xpc_stats_op serialize, deserialize;
+    uint64_t dict_probe_histogram[XPC_STATS_PROBE_HISTOGRAM_SIZE]; // index slots visited per lookup, last is open
+};
+
+bool xpc_stats_snapshot(struct xpc_stats *stats);
+
+#endif //XPC_STATS_H
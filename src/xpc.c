@@ -1,31 +1,79 @@
 #include <xpc/xpc.h>
 #include "xpc_internal.h"
 #include <string.h>
-#include <malloc.h>
+#include <stdlib.h>
 #include <math.h>
 #include <sys/param.h>
 
-static void _xpc_dictionary_free(xpc_object_t obj);
-static void _xpc_array_free(xpc_object_t obj);
+static void _xpc_dictionary_free(xpc_object_t obj, bool recursive);
+static void _xpc_array_free(xpc_object_t obj, bool recursive);
+
+static void *_xpc_default_malloc(void *ctx, size_t size) {
+    (void) ctx;
+    return malloc(size);
+}
+static void *_xpc_default_realloc(void *ctx, void *ptr, size_t size) {
+    (void) ctx;
+    return realloc(ptr, size);
+}
+static void _xpc_default_free(void *ctx, void *ptr) {
+    (void) ctx;
+    free(ptr);
+}
+static const struct xpc_allocator _xpc_default_allocator = {
+    _xpc_default_malloc, _xpc_default_realloc, _xpc_default_free, NULL
+};
+struct xpc_allocator _xpc_allocator = {
+    _xpc_default_malloc, _xpc_default_realloc, _xpc_default_free, NULL
+};
+
+void xpc_set_allocator(const struct xpc_allocator *allocator) {
+    _xpc_allocator = allocator ? *allocator : _xpc_default_allocator;
+}
 
 static struct xpc_value *_xpc_alloc_value(enum xpc_value_type type, size_t data_size) {
-    struct xpc_value *val = malloc(sizeof(struct xpc_value) + data_size);
+    struct xpc_value *val = _xpc_mem_alloc(sizeof(struct xpc_value) + data_size);
     val->type = type;
+    val->flags = 0;
+    XPC_STATS_OBJECT_ALLOC(type, sizeof(struct xpc_value) + data_size);
     return val;
 }
 
+static inline size_t _xpc_value_size(struct xpc_value *v) {
+    switch (v->type) {
+        case XPC_BOOL:
+            return sizeof(struct xpc_value) + sizeof(bool);
+        case XPC_UUID:
+            return sizeof(struct xpc_value) + sizeof(unsigned char[16]);
+        case XPC_DATA:
+        case XPC_STRING:
+            return sizeof(struct xpc_value_varlen) + ((struct xpc_value_varlen *) v)->size;
+        default:
+            return sizeof(struct xpc_value) + sizeof(int64_t);
+    }
+}
+
+void _xpc_free_object(xpc_object_t obj, bool recursive) {
+    struct xpc_value *v = (struct xpc_value *) obj;
+    if (v->type == XPC_DICTIONARY) {
+        _xpc_dictionary_free(v, recursive);
+    } else if (v->type == XPC_ARRAY) {
+        _xpc_array_free(v, recursive);
+    } else {
+        XPC_STATS_OBJECT_FREE(v->type, _xpc_value_size(v));
+        _xpc_mem_free(v);
+    }
+}
+
 void xpc_free(xpc_object_t obj) {
     struct xpc_value *v;
     if (!obj)
         return;
 
     v = (struct xpc_value *) obj;
-    if (v->type == XPC_DICTIONARY)
-        _xpc_dictionary_free(v);
-    else if (v->type == XPC_ARRAY)
-        _xpc_array_free(v);
-    else
-        free(v);
+    if (v->flags & XPC_FLAG_INTERNED)
+        return;
+    _xpc_free_object(obj, true);
 }
 
 xpc_type_t xpc_get_type(xpc_object_t obj) {
@@ -80,9 +128,11 @@ const unsigned char *xpc_uuid_get_bytes(xpc_object_t obj) {
 }
 
 static struct xpc_value_varlen *_xpc_alloc_value_varlen(enum xpc_value_type type, size_t data_size) {
-    struct xpc_value_varlen *val = malloc(sizeof(struct xpc_value_varlen) + data_size);
+    struct xpc_value_varlen *val = _xpc_mem_alloc(sizeof(struct xpc_value_varlen) + data_size);
     val->type = type;
+    val->flags = 0;
     val->size = data_size;
+    XPC_STATS_OBJECT_ALLOC(type, sizeof(struct xpc_value_varlen) + data_size);
     return val;
 }
 xpc_object_t xpc_data_create(const void *value, size_t length) {
@@ -125,7 +175,7 @@ const char *xpc_string_get_string_ptr(xpc_object_t obj) {
     return v->value;
 }
 
-static unsigned long _xpc_dictionary_hash_key(const char *str) {
+unsigned long _xpc_dictionary_hash_key(const char *str) {
     unsigned long hash = 5381;
     while (*str) {
         hash = (hash * 33) + (unsigned char) (*str);
@@ -135,80 +185,207 @@ static unsigned long _xpc_dictionary_hash_key(const char *str) {
 }
 xpc_object_t xpc_dictionary_create(const char **keys, const xpc_object_t *values, size_t count) {
     size_t i;
-    struct xpc_dict *dict = malloc(sizeof(struct xpc_dict));
+    struct xpc_dict *dict = _xpc_mem_alloc(sizeof(struct xpc_dict));
+    XPC_STATS_OBJECT_ALLOC(XPC_DICTIONARY, sizeof(struct xpc_dict));
     dict->type = XPC_DICTIONARY;
-    dict->count = count;
-    memset(dict->buckets, 0, sizeof(dict->buckets));
+    dict->flags = 0;
+    dict->count = 0;
+    dict->used = 0;
+    dict->index_size = 0;
+    dict->sorted = NULL;
+    dict->index = NULL;
+    dict->entries = NULL;
+    if (count > 0)
+        _xpc_dictionary_reserve(dict, count);
     for (i = 0; i < count; i++)
         xpc_dictionary_set_value(dict, keys[i], values[i]);
     return dict;
 }
-static void _xpc_dictionary_free(xpc_object_t obj) {
-    int i;
-    struct xpc_dict_el *el, *tel;
+static void _xpc_dictionary_free(xpc_object_t obj, bool recursive) {
+    size_t i;
+    struct xpc_dict *dict = (struct xpc_dict *) obj;
+    for (i = 0; i < dict->used; ++i) {
+        if (!dict->entries[i].value)
+            continue;
+        if (recursive)
+            xpc_free(dict->entries[i].value);
+        XPC_STATS_BYTES_FREE(XPC_DICTIONARY, dict->entries[i].key_length + 1);
+        _xpc_mem_free(dict->entries[i].key);
+    }
+    XPC_STATS_BYTES_FREE(XPC_DICTIONARY, dict->index_size ? XPC_DICT_INDEX_BYTES(dict->index_size) : 0);
+    XPC_STATS_OBJECT_FREE(XPC_DICTIONARY, sizeof(struct xpc_dict));
+    _xpc_mem_free(dict->index);
+    _xpc_mem_free(dict->sorted);
+    _xpc_mem_free(obj);
+}
+static void _xpc_dictionary_resize(struct xpc_dict *dict, size_t min_usable) {
+    size_t index_size = XPC_DICT_MIN_INDEX_SIZE, i, j, n = 0;
+    uint32_t *index;
+    struct xpc_dict_entry *entries;
+    while (XPC_DICT_USABLE(index_size) < min_usable)
+        index_size *= 2;
+    index = _xpc_mem_alloc(XPC_DICT_INDEX_BYTES(index_size));
+    XPC_STATS_BYTES_ALLOC(XPC_DICTIONARY, XPC_DICT_INDEX_BYTES(index_size));
+    entries = (struct xpc_dict_entry *) &index[index_size];
+    memset(index, 0xff, index_size * sizeof(uint32_t));
+    for (i = 0; i < dict->used; ++i) {
+        if (!dict->entries[i].value)
+            continue;
+        entries[n] = dict->entries[i];
+        j = entries[n].hash & (index_size - 1);
+        while (index[j] != XPC_DICT_IX_EMPTY)
+            j = (j + 1) & (index_size - 1);
+        index[j] = (uint32_t) n;
+        ++n;
+    }
+    XPC_STATS_BYTES_FREE(XPC_DICTIONARY, dict->index_size ? XPC_DICT_INDEX_BYTES(dict->index_size) : 0);
+    _xpc_mem_free(dict->index);
+    dict->index = index;
+    dict->entries = entries;
+    dict->index_size = index_size;
+    dict->used = n;
+}
+void _xpc_dictionary_reserve(xpc_object_t obj, size_t count) {
     struct xpc_dict *dict = (struct xpc_dict *) obj;
-    for (i = 0; i < XPC_DICT_NBUCKETS; ++i) {
-        el = dict->buckets[i];
-        while (el) {
-            xpc_free(el->value);
-            tel = el;
-            el = el->next;
-            free(tel);
+    if (XPC_DICT_USABLE(dict->index_size) < count)
+        _xpc_dictionary_resize(dict, count);
+}
+static size_t _xpc_dictionary_lookup(struct xpc_dict *dict, const char *key, unsigned long key_hash, size_t *slotp) {
+    size_t mask = dict->index_size - 1, i, free_slot = SIZE_MAX;
+    uint32_t ix;
+    struct xpc_dict_entry *e;
+    if (dict->index_size == 0)
+        return XPC_DICT_IX_EMPTY;
+    i = key_hash & mask;
+    while (true) {
+        ix = dict->index[i];
+        if (ix == XPC_DICT_IX_EMPTY) {
+            XPC_STATS_DICT_PROBE(((i - key_hash) & mask) + 1);
+            *slotp = (free_slot != SIZE_MAX ? free_slot : i);
+            return XPC_DICT_IX_EMPTY;
+        }
+        if (ix == XPC_DICT_IX_DUMMY) {
+            if (free_slot == SIZE_MAX)
+                free_slot = i;
+        } else {
+            e = &dict->entries[ix];
+            if (e->hash == key_hash && strcmp(e->key, key) == 0) {
+                XPC_STATS_DICT_PROBE(((i - key_hash) & mask) + 1);
+                *slotp = i;
+                return ix;
+            }
         }
+        i = (i + 1) & mask;
     }
-    free(obj);
 }
-static struct xpc_dict_el *xpc_dictionary_find_el(xpc_object_t obj, const char *key, unsigned long key_hash) {
+struct xpc_dict_entry *_xpc_dictionary_find_entry(xpc_object_t obj, const char *key, unsigned long key_hash) {
     struct xpc_dict *dict = (struct xpc_dict *) obj;
-    struct xpc_dict_el *el;
-    el = dict->buckets[XPC_DICT_BUCKET(key_hash)];
-    while (el) {
-        if (el->hash == key_hash && strcmp(el->key, key) == 0)
-            return el;
-        el = el->next;
-    }
-    return NULL;
+    size_t slot;
+    size_t ix = _xpc_dictionary_lookup(dict, key, key_hash, &slot);
+    return ix != XPC_DICT_IX_EMPTY ? &dict->entries[ix] : NULL;
 }
 xpc_object_t xpc_dictionary_get_value(xpc_object_t obj, const char *key) {
     unsigned long key_hash = _xpc_dictionary_hash_key(key);
-    struct xpc_dict_el *el = xpc_dictionary_find_el(obj, key, key_hash);
-    return el ? el->value : NULL;
+    struct xpc_dict_entry *e = _xpc_dictionary_find_entry(obj, key, key_hash);
+    return e ? e->value : NULL;
 }
 void xpc_dictionary_set_value(xpc_object_t obj, const char *key, xpc_object_t value) {
     struct xpc_dict *dict = (struct xpc_dict *) obj;
     unsigned long key_hash = _xpc_dictionary_hash_key(key);
-    size_t key_length;
-    struct xpc_dict_el *el = xpc_dictionary_find_el(obj, key, key_hash);
+    size_t key_length, slot;
+    size_t ix = _xpc_dictionary_lookup(dict, key, key_hash, &slot);
+    struct xpc_dict_entry *e;
 
     if (!value) {
-        if (el) {
-            if (el->prev)
-                el->prev->next = el->next;
-            if (el->next)
-                el->next->prev = el->prev;
-            xpc_free(el->value);
-            free(el);
+        if (ix != XPC_DICT_IX_EMPTY) {
+            e = &dict->entries[ix];
+            dict->index[slot] = XPC_DICT_IX_DUMMY;
+            xpc_free(e->value);
+            XPC_STATS_BYTES_FREE(XPC_DICTIONARY, e->key_length + 1);
+            _xpc_mem_free(e->key);
+            e->value = NULL;
+            e->key = NULL;
             --dict->count;
+            _xpc_mem_free(dict->sorted);
+            dict->sorted = NULL;
         }
         return;
     }
-    if (el) {
-        xpc_free(el->value);
-        el->value = value;
-    } else {
-        key_length = strlen(key);
-        el = malloc(sizeof(struct xpc_dict_el) + key_length + 1);
-        el->prev = NULL;
-        el->next = dict->buckets[XPC_DICT_BUCKET(key_hash)];
-        if (el->next)
-            el->next->prev = el;
-        el->key_length = key_length;
-        memcpy(el->key, key, key_length + 1);
-        el->hash = key_hash;
-        el->value = value;
-        dict->buckets[XPC_DICT_BUCKET(key_hash)] = el;
-        ++dict->count;
+    if (ix != XPC_DICT_IX_EMPTY) {
+        e = &dict->entries[ix];
+        xpc_free(e->value);
+        e->value = value;
+        return;
+    }
+    if (dict->used >= XPC_DICT_USABLE(dict->index_size)) {
+        _xpc_dictionary_resize(dict, MAX(dict->count * 2, dict->count + 1));
+        _xpc_dictionary_lookup(dict, key, key_hash, &slot);
+    }
+    key_length = strlen(key);
+    e = &dict->entries[dict->used];
+    e->hash = key_hash;
+    e->value = value;
+    e->key_length = key_length;
+    e->key = _xpc_mem_alloc(key_length + 1);
+    XPC_STATS_BYTES_ALLOC(XPC_DICTIONARY, key_length + 1);
+    memcpy(e->key, key, key_length + 1);
+    dict->index[slot] = (uint32_t) dict->used;
+    ++dict->used;
+    ++dict->count;
+    _xpc_mem_free(dict->sorted);
+    dict->sorted = NULL;
+}
+static int _xpc_dictionary_entry_compare(const void *a, const void *b) {
+    return strcmp((*(struct xpc_dict_entry **) a)->key, (*(struct xpc_dict_entry **) b)->key);
+}
+/* Readers may race to build the index, it is only published once fully sorted and the loser frees its copy. */
+struct xpc_dict_entry **_xpc_dictionary_sorted(xpc_object_t obj) {
+    struct xpc_dict *dict = (struct xpc_dict *) obj;
+    struct xpc_dict_entry **sorted = __atomic_load_n(&dict->sorted, __ATOMIC_ACQUIRE), **expected = NULL;
+    size_t i, n = 0;
+    if (sorted || dict->count == 0)
+        return sorted;
+    sorted = _xpc_mem_alloc(dict->count * sizeof(struct xpc_dict_entry *));
+    for (i = 0; i < dict->used; ++i) {
+        if (dict->entries[i].value)
+            sorted[n++] = &dict->entries[i];
+    }
+    qsort(sorted, n, sizeof(struct xpc_dict_entry *), _xpc_dictionary_entry_compare);
+    if (!__atomic_compare_exchange_n(&dict->sorted, &expected, sorted, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        _xpc_mem_free(sorted);
+        return expected;
+    }
+    return sorted;
+}
+size_t xpc_dictionary_get_count(xpc_object_t obj) {
+    struct xpc_dict *dict = (struct xpc_dict *) obj;
+    return dict->count;
+}
+bool xpc_dictionary_apply_f(xpc_object_t obj, void *ctx, xpc_dictionary_applier_f applier) {
+    struct xpc_dict *dict = (struct xpc_dict *) obj;
+    size_t i;
+    for (i = 0; i < dict->used; ++i) {
+        if (dict->entries[i].value && !applier(ctx, dict->entries[i].key, dict->entries[i].value))
+            return false;
+    }
+    return true;
+}
+void xpc_dictionary_iter_init(xpc_dictionary_iter_t *it, xpc_object_t obj) {
+    it->dict = obj;
+    it->pos = 0;
+}
+bool xpc_dictionary_iter_next(xpc_dictionary_iter_t *it, const char **key, xpc_object_t *value) {
+    struct xpc_dict *dict = (struct xpc_dict *) it->dict;
+    struct xpc_dict_entry *e;
+    while (it->pos < dict->used) {
+        e = &dict->entries[it->pos++];
+        if (e->value) {
+            *key = e->key;
+            *value = e->value;
+            return true;
+        }
     }
+    return false;
 }
 
 bool xpc_dictionary_get_bool(xpc_object_t obj, const char *key) {
@@ -261,40 +438,48 @@ void xpc_dictionary_set_string(xpc_object_t obj, const char *key, const char *va
 }
 
 xpc_object_t xpc_array_create(const xpc_object_t *values, size_t count) {
-    struct xpc_array *arr = malloc(sizeof(struct xpc_array));
+    struct xpc_array *arr = _xpc_mem_alloc(sizeof(struct xpc_array));
+    XPC_STATS_OBJECT_ALLOC(XPC_ARRAY, sizeof(struct xpc_array) + count * sizeof(xpc_object_t));
     arr->type = XPC_ARRAY;
+    arr->flags = 0;
     arr->count = count;
     arr->mem_count = count;
     arr->value = NULL;
     if (count > 0) {
-        arr->value = malloc(count * sizeof(xpc_object_t));
+        arr->value = _xpc_mem_alloc(count * sizeof(xpc_object_t));
         memcpy(arr->value, values, count * sizeof(xpc_object_t));
     }
     return arr;
 }
 xpc_object_t xpc_array_create_preallocated(size_t mem_count) {
-    struct xpc_array *arr = malloc(sizeof(struct xpc_array));
+    struct xpc_array *arr = _xpc_mem_alloc(sizeof(struct xpc_array));
+    XPC_STATS_OBJECT_ALLOC(XPC_ARRAY, sizeof(struct xpc_array) + mem_count * sizeof(xpc_object_t));
     arr->type = XPC_ARRAY;
+    arr->flags = 0;
     arr->count = 0;
     arr->mem_count = mem_count;
     arr->value = NULL;
     if (mem_count > 0)
-        arr->value = malloc(mem_count * sizeof(xpc_object_t));
+        arr->value = _xpc_mem_alloc(mem_count * sizeof(xpc_object_t));
     return arr;
 }
-static void _xpc_array_free(xpc_object_t obj) {
+static void _xpc_array_free(xpc_object_t obj, bool recursive) {
     size_t i;
     struct xpc_array *arr = (struct xpc_array *) obj;
-    for (i = 0; i < arr->count; i++)
-        xpc_free(arr->value[i]);
-    free(arr->value);
-    free(obj);
+    if (recursive) {
+        for (i = 0; i < arr->count; i++)
+            xpc_free(arr->value[i]);
+    }
+    XPC_STATS_OBJECT_FREE(XPC_ARRAY, sizeof(struct xpc_array) + arr->mem_count * sizeof(xpc_object_t));
+    _xpc_mem_free(arr->value);
+    _xpc_mem_free(obj);
 }
 void xpc_array_append_value(xpc_object_t obj, xpc_object_t value) {
     struct xpc_array *arr = (struct xpc_array *) obj;
     if (arr->count >= arr->mem_count) {
+        XPC_STATS_BYTES_ALLOC(XPC_ARRAY, (MAX(arr->mem_count * 2, 4) - arr->mem_count) * sizeof(xpc_object_t));
         arr->mem_count = MAX(arr->mem_count * 2, 4);
-        arr->value = realloc(arr->value, arr->mem_count * sizeof(xpc_object_t));
+        arr->value = _xpc_mem_realloc(arr->value, arr->mem_count * sizeof(xpc_object_t));
     }
     arr->value[arr->count] = value;
     ++arr->count;
@@ -306,4 +491,17 @@ void xpc_array_set_value(xpc_object_t obj, size_t index, xpc_object_t value) {
 xpc_object_t xpc_array_get_value(xpc_object_t obj, size_t index) {
     struct xpc_array *arr = (struct xpc_array *) obj;
     return arr->value[index];
+}
+size_t xpc_array_get_count(xpc_object_t obj) {
+    struct xpc_array *arr = (struct xpc_array *) obj;
+    return arr->count;
+}
+bool xpc_array_apply_f(xpc_object_t obj, void *ctx, xpc_array_applier_f applier) {
+    struct xpc_array *arr = (struct xpc_array *) obj;
+    size_t i;
+    for (i = 0; i < arr->count; i++) {
+        if (!applier(ctx, i, arr->value[i]))
+            return false;
+    }
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <xpc/xpc_archive.h>
+#include <xpc/xpc_serialization.h>
+#include "xpc_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define XPC_ARCHIVE_MAGIC 0x41435058
+#define XPC_ARCHIVE_VERSION 1
+
+#define XPC_ARCHIVE_PAGE_SIZE 4096
+#define XPC_ARCHIVE_INITIAL_TABLE_SHIFT 10
+#define XPC_ARCHIVE_INITIAL_SIZE (64 * 1024)
+
+#define XPC_ARCHIVE_PAD(len) (((len) + 7) / 8 * 8)
+#define XPC_ARCHIVE_ALIGN_PAGE(off) (((off) + XPC_ARCHIVE_PAGE_SIZE - 1) / XPC_ARCHIVE_PAGE_SIZE * XPC_ARCHIVE_PAGE_SIZE)
+
+/* The table offset is page aligned, so the low bits of the reference hold log2 of the slot count. This lets the writer
+ * switch to a bigger table with a single store. */
+#define XPC_ARCHIVE_TABLE_REF(off, shift) ((off) | (shift))
+#define XPC_ARCHIVE_TABLE_OFFSET(ref) ((ref) & ~(uint64_t) (XPC_ARCHIVE_PAGE_SIZE - 1))
+#define XPC_ARCHIVE_TABLE_SHIFT(ref) ((ref) & (XPC_ARCHIVE_PAGE_SIZE - 1))
+
+/* File layout: this header in the first page, followed by append-only records and index tables. A superseded table is
+ * left in place, readers still holding its reference keep seeing a consistent snapshot. */
+struct xpc_archive_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t table_ref;
+    uint64_t count;
+    uint64_t data_end;
+};
+/* A slot is published by storing its hash last, a zero hash marks an empty slot. */
+struct xpc_archive_slot {
+    uint64_t hash;
+    uint64_t offset;
+};
+/* Followed by the NUL terminated key and the serialized value, each padded to 8 bytes. */
+struct xpc_archive_record {
+    uint32_t key_length;
+    uint32_t value_length;
+};
+
+struct xpc_archive {
+    int fd;
+    bool writable;
+    uint8_t *map;
+    size_t map_size;
+};
+
+#define XPC_ARCHIVE_HEADER(a) ((struct xpc_archive_header *) (a)->map)
+
+/* The header comes from the file, its table has to lie within the part of the file that is in use. */
+static bool _xpc_archive_table_valid(uint64_t table_ref, uint64_t data_end) {
+    uint64_t offset = XPC_ARCHIVE_TABLE_OFFSET(table_ref), shift = XPC_ARCHIVE_TABLE_SHIFT(table_ref);
+    if (shift < XPC_ARCHIVE_INITIAL_TABLE_SHIFT || shift > 63 || offset < XPC_ARCHIVE_PAGE_SIZE || offset > data_end)
+        return false;
+    return ((data_end - offset) / sizeof(struct xpc_archive_slot)) >> shift != 0;
+}
+
+static int _xpc_archive_map(struct xpc_archive *a, size_t size) {
+    void *map;
+    if (a->map)
+        map = mremap(a->map, a->map_size, size, MREMAP_MAYMOVE);
+    else
+        map = mmap(NULL, size, a->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, a->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    a->map = (uint8_t *) map;
+    a->map_size = size;
+    return 0;
+}
+
+/* Readers remap when the writer has grown the file past what is currently mapped. */
+static bool _xpc_archive_ensure_mapped(struct xpc_archive *a, uint64_t end) {
+    struct stat st;
+    if (end <= a->map_size)
+        return true;
+    if (a->writable || fstat(a->fd, &st) < 0 || (uint64_t) st.st_size < end)
+        return false;
+    return _xpc_archive_map(a, st.st_size) == 0;
+}
+
+/* Writers grow the file geometrically, data_end in the header marks how much of it is in use. */
+static int _xpc_archive_reserve(struct xpc_archive *a, uint64_t end) {
+    size_t size = a->map_size;
+    if (end <= a->map_size)
+        return 0;
+    while (size < end)
+        size *= 2;
+    if (ftruncate(a->fd, size) < 0)
+        return -1;
+    return _xpc_archive_map(a, size);
+}
+
+static int _xpc_archive_init(struct xpc_archive *a) {
+    struct xpc_archive_header *hdr;
+    size_t table_size = ((size_t) 1 << XPC_ARCHIVE_INITIAL_TABLE_SHIFT) * sizeof(struct xpc_archive_slot);
+    if (ftruncate(a->fd, XPC_ARCHIVE_INITIAL_SIZE) < 0 || _xpc_archive_map(a, XPC_ARCHIVE_INITIAL_SIZE) < 0)
+        return -1;
+    hdr = XPC_ARCHIVE_HEADER(a);
+    hdr->version = XPC_ARCHIVE_VERSION;
+    hdr->table_ref = XPC_ARCHIVE_TABLE_REF(XPC_ARCHIVE_PAGE_SIZE, XPC_ARCHIVE_INITIAL_TABLE_SHIFT);
+    hdr->count = 0;
+    hdr->data_end = XPC_ARCHIVE_PAGE_SIZE + table_size;
+    __atomic_store_n(&hdr->magic, XPC_ARCHIVE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+xpc_archive_t xpc_archive_open(const char *path, int flags) {
+    struct xpc_archive *a;
+    struct xpc_archive_header *hdr;
+    struct stat st;
+    bool writable = (flags & XPC_ARCHIVE_WRITE) != 0;
+    int fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    if ((writable && flock(fd, LOCK_EX | LOCK_NB) < 0) || fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    a = _xpc_mem_alloc(sizeof(struct xpc_archive));
+    a->fd = fd;
+    a->writable = writable;
+    a->map = NULL;
+    a->map_size = 0;
+    if (st.st_size == 0 && writable) {
+        if (_xpc_archive_init(a) < 0)
+            goto fail;
+    } else if ((size_t) st.st_size < sizeof(struct xpc_archive_header) || _xpc_archive_map(a, st.st_size) < 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+    hdr = XPC_ARCHIVE_HEADER(a);
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != XPC_ARCHIVE_MAGIC || hdr->version != XPC_ARCHIVE_VERSION ||
+        hdr->data_end > a->map_size || !_xpc_archive_table_valid(hdr->table_ref, hdr->data_end)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    return a;
+
+fail:
+    if (a->map)
+        munmap(a->map, a->map_size);
+    close(fd);
+    _xpc_mem_free(a);
+    return NULL;
+}
+
+void xpc_archive_close(xpc_archive_t a) {
+    if (!a)
+        return;
+    munmap(a->map, a->map_size);
+    close(a->fd);
+    _xpc_mem_free(a);
+}
+
+int xpc_archive_sync(xpc_archive_t a) {
+    if (msync(a->map, a->map_size, MS_SYNC) < 0)
+        return -1;
+    return fdatasync(a->fd);
+}
+
+size_t xpc_archive_get_count(xpc_archive_t a) {
+    return __atomic_load_n(&XPC_ARCHIVE_HEADER(a)->count, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t _xpc_archive_hash_key(const char *key, size_t key_length) {
+    uint64_t hash = _xpc_hash_bytes(XPC_ARCHIVE_MAGIC, key, key_length);
+    return hash ? hash : 1;
+}
+
+static bool _xpc_archive_record_matches(struct xpc_archive *a, uint64_t offset, const char *key, size_t key_length) {
+    struct xpc_archive_record *rec;
+    if (!_xpc_archive_ensure_mapped(a, offset + sizeof(struct xpc_archive_record)))
+        return false;
+    rec = (struct xpc_archive_record *) &a->map[offset];
+    if (rec->key_length != key_length)
+        return false;
+    if (!_xpc_archive_ensure_mapped(a, offset + sizeof(struct xpc_archive_record) + key_length))
+        return false;
+    rec = (struct xpc_archive_record *) &a->map[offset];
+    return memcmp(rec + 1, key, key_length) == 0;
+}
+
+/* Returns the index of the slot holding the key, or of the empty slot where it belongs. A corrupt table may have no
+ * empty slot at all, SIZE_MAX is returned then. */
+static size_t _xpc_archive_find_slot(struct xpc_archive *a, uint64_t table_ref, const char *key, size_t key_length,
+                                     uint64_t hash, bool *found) {
+    size_t mask = ((size_t) 1 << XPC_ARCHIVE_TABLE_SHIFT(table_ref)) - 1;
+    size_t i = hash & mask, n;
+    struct xpc_archive_slot *slot;
+    uint64_t slot_hash, offset;
+    *found = false;
+    for (n = 0; n <= mask; n++) {
+        slot = &((struct xpc_archive_slot *) &a->map[XPC_ARCHIVE_TABLE_OFFSET(table_ref)])[i];
+        slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+        if (slot_hash == 0)
+            return i;
+        if (slot_hash == hash) {
+            offset = __atomic_load_n(&slot->offset, __ATOMIC_ACQUIRE);
+            if (_xpc_archive_record_matches(a, offset, key, key_length)) {
+                *found = true;
+                return i;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    return SIZE_MAX;
+}
+
+const uint8_t *xpc_archive_get_bytes(xpc_archive_t a, const char *key, size_t *len) {
+    struct xpc_archive_record *rec;
+    struct xpc_archive_slot *slot;
+    size_t key_length = strlen(key), i;
+    uint64_t table_ref, table_end, offset, value_off;
+    bool found;
+    table_ref = __atomic_load_n(&XPC_ARCHIVE_HEADER(a)->table_ref, __ATOMIC_ACQUIRE);
+    // The writer stores data_end before switching tables, so a valid reference never points past it
+    if (!_xpc_archive_table_valid(table_ref, __atomic_load_n(&XPC_ARCHIVE_HEADER(a)->data_end, __ATOMIC_ACQUIRE))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    table_end = XPC_ARCHIVE_TABLE_OFFSET(table_ref) +
+                ((uint64_t) 1 << XPC_ARCHIVE_TABLE_SHIFT(table_ref)) * sizeof(struct xpc_archive_slot);
+    if (!_xpc_archive_ensure_mapped(a, table_end))
+        return NULL;
+    i = _xpc_archive_find_slot(a, table_ref, key, key_length, _xpc_archive_hash_key(key, key_length), &found);
+    if (!found)
+        return NULL;
+    slot = &((struct xpc_archive_slot *) &a->map[XPC_ARCHIVE_TABLE_OFFSET(table_ref)])[i];
+    offset = __atomic_load_n(&slot->offset, __ATOMIC_ACQUIRE);
+    if (!_xpc_archive_ensure_mapped(a, offset + sizeof(struct xpc_archive_record)))
+        return NULL;
+    rec = (struct xpc_archive_record *) &a->map[offset];
+    value_off = offset + sizeof(struct xpc_archive_record) + XPC_ARCHIVE_PAD(rec->key_length + 1);
+    if (!_xpc_archive_ensure_mapped(a, value_off + rec->value_length))
+        return NULL;
+    rec = (struct xpc_archive_record *) &a->map[offset];
+    *len = rec->value_length;
+    return &a->map[value_off];
+}
+
+xpc_object_t xpc_archive_get(xpc_archive_t a, const char *key) {
+    size_t len;
+    const uint8_t *buf = xpc_archive_get_bytes(a, key, &len);
+    return buf ? xpc_deserialize(buf, len) : NULL;
+}
+
+static int _xpc_archive_grow_table(struct xpc_archive *a) {
+    struct xpc_archive_header *hdr = XPC_ARCHIVE_HEADER(a);
+    uint64_t old_ref = hdr->table_ref, new_off, new_ref;
+    size_t old_n = (size_t) 1 << XPC_ARCHIVE_TABLE_SHIFT(old_ref), new_n = old_n * 2, i, j;
+    struct xpc_archive_slot *old_slots, *new_slots;
+
+    new_off = XPC_ARCHIVE_ALIGN_PAGE(hdr->data_end);
+    if (_xpc_archive_reserve(a, new_off + new_n * sizeof(struct xpc_archive_slot)) < 0)
+        return -1;
+    hdr = XPC_ARCHIVE_HEADER(a);
+    old_slots = (struct xpc_archive_slot *) &a->map[XPC_ARCHIVE_TABLE_OFFSET(old_ref)];
+    new_slots = (struct xpc_archive_slot *) &a->map[new_off];
+    memset(new_slots, 0, new_n * sizeof(struct xpc_archive_slot));
+    for (i = 0; i < old_n; i++) {
+        if (!old_slots[i].hash)
+            continue;
+        j = old_slots[i].hash & (new_n - 1);
+        while (new_slots[j].hash)
+            j = (j + 1) & (new_n - 1);
+        new_slots[j] = old_slots[i];
+    }
+    new_ref = XPC_ARCHIVE_TABLE_REF(new_off, XPC_ARCHIVE_TABLE_SHIFT(old_ref) + 1);
+    __atomic_store_n(&hdr->data_end, new_off + new_n * sizeof(struct xpc_archive_slot), __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->table_ref, new_ref, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Appends a record with room for len value bytes and returns its offset, the caller fills in the value. */
+static int _xpc_archive_append(struct xpc_archive *a, const char *key, size_t key_length, size_t len,
+                               uint64_t *offsetp) {
+    struct xpc_archive_record *rec;
+    uint64_t offset = XPC_ARCHIVE_HEADER(a)->data_end;
+    size_t key_size = XPC_ARCHIVE_PAD(key_length + 1);
+    if (!a->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    if (key_length > UINT32_MAX || len > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (_xpc_archive_reserve(a, offset + sizeof(struct xpc_archive_record) + key_size + XPC_ARCHIVE_PAD(len)) < 0)
+        return -1;
+    rec = (struct xpc_archive_record *) &a->map[offset];
+    rec->key_length = (uint32_t) key_length;
+    rec->value_length = (uint32_t) len;
+    memset(rec + 1, 0, key_size);
+    memcpy(rec + 1, key, key_length);
+    *offsetp = offset;
+    return 0;
+}
+
+/* Makes an appended record visible: its slot is published only after the record bytes are in place. */
+static int _xpc_archive_commit(struct xpc_archive *a, const char *key, size_t key_length, uint64_t offset) {
+    struct xpc_archive_header *hdr = XPC_ARCHIVE_HEADER(a);
+    struct xpc_archive_record *rec = (struct xpc_archive_record *) &a->map[offset];
+    struct xpc_archive_slot *slot;
+    uint64_t hash = _xpc_archive_hash_key(key, key_length);
+    size_t i;
+    bool found;
+    __atomic_store_n(&hdr->data_end, offset + sizeof(struct xpc_archive_record) +
+                     XPC_ARCHIVE_PAD(key_length + 1) + XPC_ARCHIVE_PAD(rec->value_length), __ATOMIC_RELEASE);
+    if ((hdr->count + 1) * 4 > ((uint64_t) 3 << XPC_ARCHIVE_TABLE_SHIFT(hdr->table_ref))) {
+        if (_xpc_archive_grow_table(a) < 0)
+            return -1;
+        hdr = XPC_ARCHIVE_HEADER(a);
+    }
+    i = _xpc_archive_find_slot(a, hdr->table_ref, key, key_length, hash, &found);
+    if (i == SIZE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    slot = &((struct xpc_archive_slot *) &a->map[XPC_ARCHIVE_TABLE_OFFSET(hdr->table_ref)])[i];
+    __atomic_store_n(&slot->offset, offset, __ATOMIC_RELEASE);
+    if (!found) {
+        __atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+        __atomic_store_n(&hdr->count, hdr->count + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int xpc_archive_put_bytes(xpc_archive_t a, const char *key, const uint8_t *buf, size_t len) {
+    size_t key_length = strlen(key);
+    uint64_t offset;
+    if (_xpc_archive_append(a, key, key_length, len, &offset) < 0)
+        return -1;
+    memcpy(&a->map[offset + sizeof(struct xpc_archive_record) + XPC_ARCHIVE_PAD(key_length + 1)], buf, len);
+    return _xpc_archive_commit(a, key, key_length, offset);
+}
+
+int xpc_archive_put(xpc_archive_t a, const char *key, xpc_object_t obj) {
+    size_t key_length = strlen(key), len = xpc_serialized_size(obj);
+    uint64_t offset;
+    if (_xpc_archive_append(a, key, key_length, len, &offset) < 0)
+        return -1;
+    xpc_serialize(obj, &a->map[offset + sizeof(struct xpc_archive_record) + XPC_ARCHIVE_PAD(key_length + 1)]);
+    return _xpc_archive_commit(a, key, key_length, offset);
+}
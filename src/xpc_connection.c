@@ -0,0 +1,802 @@
+#define _GNU_SOURCE
+#include <xpc/xpc_connection.h>
+#include <xpc/xpc_serialization.h>
+#include "xpc_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define XPC_FRAME_REPLY 1
+#define XPC_FRAME_WANTS_REPLY 2
+#define XPC_FRAME_MAX_SIZE (256 * 1024 * 1024)
+
+#define XPC_CONNECTION_MAX_IOV 64
+#define XPC_CONNECTION_READ_SIZE 65536
+#define XPC_CONNECTION_PENDING_BUCKETS 64
+#define XPC_DISPATCH_MAX_EVENTS 64
+
+struct xpc_frame_header {
+    uint32_t size;
+    uint32_t flags;
+    uint64_t id;
+};
+
+/* Everything registered with a dispatch thread. It is only ever closed by its owning thread: other threads queue a
+ * close request and wake the thread up. */
+struct xpc_io {
+    int fd;
+    struct xpc_dispatch_thread *thread;
+    void (*on_event)(struct xpc_io *io, uint32_t events);
+    void (*on_close_request)(struct xpc_io *io);
+    struct xpc_io *next_close;
+};
+
+struct xpc_dispatch_thread {
+    struct xpc_dispatch *dispatch;
+    pthread_t thread;
+    int epoll_fd, wake_fd;
+    pthread_mutex_t lock;
+    struct xpc_io *close_queue;
+};
+struct xpc_dispatch {
+    unsigned int nthreads, next_thread;
+    bool stopping;
+    struct xpc_dispatch_thread threads[];
+};
+
+struct xpc_out_frame {
+    struct xpc_out_frame *next;
+    size_t size;
+    uint8_t data[];
+};
+struct xpc_pending_reply {
+    struct xpc_pending_reply *next;
+    uint64_t id;
+    xpc_connection_reply_handler_f handler;
+    void *ctx;
+};
+
+struct xpc_listener {
+    struct xpc_io io;
+    struct xpc_dispatch *dispatch;
+    xpc_connection_handler_f handler;
+    void *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool closed;
+    struct xpc_connection *peers;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+};
+
+struct xpc_connection {
+    struct xpc_io io;
+    struct xpc_listener *listener; /* NULL for client connections */
+    struct xpc_connection *peer_prev, *peer_next;
+    bool close_posted;
+    bool released; /* the close request of a client connection has been processed */
+    unsigned int refs; /* peers only: one held while open, plus one per xpc_connection_retain */
+
+    /* Read state, only touched by the owning dispatch thread */
+    uint8_t *rbuf;
+    size_t rbuf_len, rbuf_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool closed;
+    bool corked; /* output is held back while a batch of incoming frames is processed */
+    bool want_write; /* EPOLLOUT is armed */
+    xpc_connection_close_handler_f close_handler;
+    void *close_ctx;
+    struct xpc_out_frame *out_head, *out_tail;
+    size_t out_off;
+    uint64_t next_id;
+    struct xpc_pending_reply *pending[XPC_CONNECTION_PENDING_BUCKETS];
+};
+
+struct xpc_sync_reply {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    xpc_object_t reply;
+};
+
+static void _xpc_connection_close(struct xpc_connection *conn);
+
+static void _xpc_dispatch_process_close_queue(struct xpc_dispatch_thread *t) {
+    struct xpc_io *io, *next;
+    uint64_t val;
+    while (read(t->wake_fd, &val, sizeof(val)) < 0 && errno == EINTR);
+    pthread_mutex_lock(&t->lock);
+    io = t->close_queue;
+    t->close_queue = NULL;
+    pthread_mutex_unlock(&t->lock);
+    for (; io; io = next) {
+        next = io->next_close;
+        io->on_close_request(io);
+    }
+}
+
+static void *_xpc_dispatch_thread_main(void *arg) {
+    struct xpc_dispatch_thread *t = (struct xpc_dispatch_thread *) arg;
+    struct epoll_event events[XPC_DISPATCH_MAX_EVENTS];
+    struct xpc_io *io;
+    int i, n;
+    bool woken;
+    while (!__atomic_load_n(&t->dispatch->stopping, __ATOMIC_ACQUIRE)) {
+        n = epoll_wait(t->epoll_fd, events, XPC_DISPATCH_MAX_EVENTS, -1);
+        woken = false;
+        for (i = 0; i < n; i++) {
+            io = (struct xpc_io *) events[i].data.ptr;
+            if (io)
+                io->on_event(io, events[i].events);
+            else
+                woken = true;
+        }
+        // Only free anything once no events referencing it are left in this batch
+        if (woken)
+            _xpc_dispatch_process_close_queue(t);
+    }
+    _xpc_dispatch_process_close_queue(t);
+    return NULL;
+}
+
+static void _xpc_dispatch_wake(struct xpc_dispatch_thread *t) {
+    uint64_t val = 1;
+    while (write(t->wake_fd, &val, sizeof(val)) < 0 && errno == EINTR);
+}
+
+static void _xpc_dispatch_post_close(struct xpc_io *io) {
+    struct xpc_dispatch_thread *t = io->thread;
+    pthread_mutex_lock(&t->lock);
+    io->next_close = t->close_queue;
+    t->close_queue = io;
+    pthread_mutex_unlock(&t->lock);
+    _xpc_dispatch_wake(t);
+}
+
+static int _xpc_dispatch_add(struct xpc_dispatch_thread *t, struct xpc_io *io, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = io;
+    io->thread = t;
+    return epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, io->fd, &ev);
+}
+
+static void _xpc_io_modify(struct xpc_io *io, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = io;
+    epoll_ctl(io->thread->epoll_fd, EPOLL_CTL_MOD, io->fd, &ev);
+}
+
+static void _xpc_io_remove(struct xpc_io *io) {
+    epoll_ctl(io->thread->epoll_fd, EPOLL_CTL_DEL, io->fd, NULL);
+    close(io->fd);
+    io->fd = -1;
+}
+
+xpc_dispatch_t xpc_dispatch_create(unsigned int nthreads) {
+    struct xpc_dispatch *dispatch;
+    struct xpc_dispatch_thread *t;
+    struct epoll_event ev;
+    unsigned int i;
+    int err;
+    if (nthreads == 0)
+        nthreads = 1;
+    dispatch = _xpc_mem_calloc(1, sizeof(struct xpc_dispatch) + nthreads * sizeof(struct xpc_dispatch_thread));
+    dispatch->nthreads = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        t = &dispatch->threads[i];
+        t->dispatch = dispatch;
+        t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        t->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&t->lock, NULL);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        err = 0;
+        if (t->epoll_fd < 0 || t->wake_fd < 0 || epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->wake_fd, &ev) < 0)
+            err = errno;
+        else
+            err = pthread_create(&t->thread, NULL, _xpc_dispatch_thread_main, t);
+        if (err) {
+            if (t->epoll_fd >= 0)
+                close(t->epoll_fd);
+            if (t->wake_fd >= 0)
+                close(t->wake_fd);
+            pthread_mutex_destroy(&t->lock);
+            // Stop the threads started so far
+            dispatch->nthreads = i;
+            xpc_dispatch_free(dispatch);
+            errno = err;
+            return NULL;
+        }
+    }
+    return dispatch;
+}
+
+void xpc_dispatch_free(xpc_dispatch_t dispatch) {
+    unsigned int i;
+    struct xpc_dispatch_thread *t;
+    __atomic_store_n(&dispatch->stopping, true, __ATOMIC_RELEASE);
+    for (i = 0; i < dispatch->nthreads; i++)
+        _xpc_dispatch_wake(&dispatch->threads[i]);
+    for (i = 0; i < dispatch->nthreads; i++) {
+        t = &dispatch->threads[i];
+        pthread_join(t->thread, NULL);
+        close(t->epoll_fd);
+        close(t->wake_fd);
+        pthread_mutex_destroy(&t->lock);
+    }
+    _xpc_mem_free(dispatch);
+}
+
+static struct xpc_dispatch_thread *_xpc_dispatch_next_thread(struct xpc_dispatch *dispatch) {
+    unsigned int i = __atomic_fetch_add(&dispatch->next_thread, 1, __ATOMIC_RELAXED);
+    return &dispatch->threads[i % dispatch->nthreads];
+}
+
+static int _xpc_socket_address(const char *path, struct sockaddr_un *addr) {
+    size_t len = strlen(path);
+    if (len >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len + 1);
+    return 0;
+}
+
+static void _xpc_connection_on_event(struct xpc_io *io, uint32_t events);
+static void _xpc_connection_on_close_request(struct xpc_io *io);
+
+static struct xpc_connection *_xpc_connection_alloc(int fd) {
+    struct xpc_connection *conn = _xpc_mem_calloc(1, sizeof(struct xpc_connection));
+    conn->io.fd = fd;
+    conn->io.on_event = _xpc_connection_on_event;
+    conn->io.on_close_request = _xpc_connection_on_close_request;
+    conn->rbuf_size = XPC_CONNECTION_READ_SIZE;
+    conn->rbuf = _xpc_mem_alloc(conn->rbuf_size);
+    conn->next_id = 1;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->cond, NULL);
+    return conn;
+}
+
+static void _xpc_connection_dealloc(struct xpc_connection *conn) {
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+    _xpc_mem_free(conn->rbuf);
+    _xpc_mem_free(conn);
+}
+
+void xpc_connection_retain(xpc_connection_t peer) {
+    __atomic_add_fetch(&peer->refs, 1, __ATOMIC_RELAXED);
+}
+
+void xpc_connection_release(xpc_connection_t peer) {
+    if (__atomic_sub_fetch(&peer->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        _xpc_connection_dealloc(peer);
+}
+
+int xpc_connection_set_close_handler(xpc_connection_t peer, xpc_connection_close_handler_f handler, void *ctx) {
+    pthread_mutex_lock(&peer->lock);
+    if (peer->closed) {
+        pthread_mutex_unlock(&peer->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+    peer->close_handler = handler;
+    peer->close_ctx = ctx;
+    pthread_mutex_unlock(&peer->lock);
+    return 0;
+}
+
+static void _xpc_listener_on_event(struct xpc_io *io, uint32_t events) {
+    struct xpc_listener *listener = (struct xpc_listener *) io;
+    struct xpc_connection *conn;
+    int fd;
+    (void) events;
+    while (true) {
+        fd = accept4(io->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        conn = _xpc_connection_alloc(fd);
+        conn->listener = listener;
+        conn->refs = 1;
+        pthread_mutex_lock(&listener->lock);
+        conn->peer_next = listener->peers;
+        if (conn->peer_next)
+            conn->peer_next->peer_prev = conn;
+        listener->peers = conn;
+        pthread_mutex_unlock(&listener->lock);
+        if (_xpc_dispatch_add(_xpc_dispatch_next_thread(listener->dispatch), &conn->io, EPOLLIN) < 0) {
+            pthread_mutex_lock(&conn->lock);
+            _xpc_connection_close(conn);
+        }
+    }
+}
+
+static void _xpc_listener_on_close_request(struct xpc_io *io) {
+    struct xpc_listener *listener = (struct xpc_listener *) io;
+    _xpc_io_remove(io);
+    pthread_mutex_lock(&listener->lock);
+    listener->closed = true;
+    pthread_cond_broadcast(&listener->cond);
+    pthread_mutex_unlock(&listener->lock);
+}
+
+xpc_listener_t xpc_listener_create(xpc_dispatch_t dispatch, const char *path, xpc_connection_handler_f handler,
+                                   void *ctx) {
+    struct xpc_listener *listener;
+    struct sockaddr_un addr;
+    int fd;
+    if (_xpc_socket_address(path, &addr) < 0)
+        return NULL;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        unlink(addr.sun_path);
+        return NULL;
+    }
+    listener = _xpc_mem_calloc(1, sizeof(struct xpc_listener));
+    listener->io.fd = fd;
+    listener->io.on_event = _xpc_listener_on_event;
+    listener->io.on_close_request = _xpc_listener_on_close_request;
+    listener->dispatch = dispatch;
+    listener->handler = handler;
+    listener->ctx = ctx;
+    memcpy(listener->path, addr.sun_path, sizeof(listener->path));
+    pthread_mutex_init(&listener->lock, NULL);
+    pthread_cond_init(&listener->cond, NULL);
+    if (_xpc_dispatch_add(&dispatch->threads[0], &listener->io, EPOLLIN) < 0) {
+        close(fd);
+        unlink(listener->path);
+        _xpc_mem_free(listener);
+        return NULL;
+    }
+    return listener;
+}
+
+void xpc_listener_free(xpc_listener_t listener) {
+    struct xpc_connection *conn;
+    _xpc_dispatch_post_close(&listener->io);
+    pthread_mutex_lock(&listener->lock);
+    while (!listener->closed)
+        pthread_cond_wait(&listener->cond, &listener->lock);
+    for (conn = listener->peers; conn; conn = conn->peer_next) {
+        if (!conn->close_posted) {
+            conn->close_posted = true;
+            _xpc_dispatch_post_close(&conn->io);
+        }
+    }
+    while (listener->peers)
+        pthread_cond_wait(&listener->cond, &listener->lock);
+    pthread_mutex_unlock(&listener->lock);
+    pthread_mutex_destroy(&listener->lock);
+    pthread_cond_destroy(&listener->cond);
+    unlink(listener->path);
+    _xpc_mem_free(listener);
+}
+
+xpc_connection_t xpc_connection_create(xpc_dispatch_t dispatch, const char *path) {
+    struct xpc_connection *conn;
+    struct sockaddr_un addr;
+    int fd;
+    if (_xpc_socket_address(path, &addr) < 0)
+        return NULL;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    // Connect blocking, all further I/O is non-blocking
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    conn = _xpc_connection_alloc(fd);
+    if (_xpc_dispatch_add(_xpc_dispatch_next_thread(dispatch), &conn->io, EPOLLIN) < 0) {
+        close(fd);
+        _xpc_connection_dealloc(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+void xpc_connection_free(xpc_connection_t conn) {
+    _xpc_dispatch_post_close(&conn->io);
+    pthread_mutex_lock(&conn->lock);
+    while (!conn->released)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    pthread_mutex_unlock(&conn->lock);
+    _xpc_connection_dealloc(conn);
+}
+
+static void _xpc_connection_flush_locked(struct xpc_connection *conn) {
+    struct iovec iov[XPC_CONNECTION_MAX_IOV];
+    struct msghdr msg;
+    struct xpc_out_frame *frame;
+    size_t off;
+    ssize_t n;
+    int cnt;
+    while (conn->out_head) {
+        cnt = 0;
+        off = conn->out_off;
+        for (frame = conn->out_head; frame && cnt < XPC_CONNECTION_MAX_IOV; frame = frame->next, ++cnt) {
+            iov[cnt].iov_base = frame->data + off;
+            iov[cnt].iov_len = frame->size - off;
+            off = 0;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        // sendmsg is writev with MSG_NOSIGNAL, a peer going away must not raise SIGPIPE
+        n = sendmsg(conn->io.fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && !conn->want_write) {
+                conn->want_write = true;
+                _xpc_io_modify(&conn->io, EPOLLIN | EPOLLOUT);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // Let the owning thread notice the error and close the connection
+                shutdown(conn->io.fd, SHUT_RDWR);
+            }
+            return;
+        }
+        while (n > 0) {
+            frame = conn->out_head;
+            if ((size_t) n < frame->size - conn->out_off) {
+                conn->out_off += n;
+                break;
+            }
+            n -= frame->size - conn->out_off;
+            conn->out_off = 0;
+            conn->out_head = frame->next;
+            _xpc_mem_free(frame);
+        }
+    }
+    conn->out_tail = NULL;
+    if (conn->want_write) {
+        conn->want_write = false;
+        _xpc_io_modify(&conn->io, EPOLLIN);
+    }
+}
+
+static struct xpc_out_frame *_xpc_connection_make_frame(xpc_object_t message, uint32_t flags, uint64_t id) {
+    size_t size = xpc_serialized_size(message);
+    struct xpc_out_frame *frame;
+    struct xpc_frame_header *hdr;
+    if (size > XPC_FRAME_MAX_SIZE) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    frame = _xpc_mem_alloc(sizeof(struct xpc_out_frame) + sizeof(struct xpc_frame_header) + size);
+    frame->next = NULL;
+    frame->size = sizeof(struct xpc_frame_header) + size;
+    hdr = (struct xpc_frame_header *) frame->data;
+    hdr->size = (uint32_t) size;
+    hdr->flags = flags;
+    hdr->id = id;
+    xpc_serialize(message, frame->data + sizeof(struct xpc_frame_header));
+    return frame;
+}
+
+static void _xpc_connection_enqueue_locked(struct xpc_connection *conn, struct xpc_out_frame *frame) {
+    if (conn->out_tail)
+        conn->out_tail->next = frame;
+    else
+        conn->out_head = frame;
+    conn->out_tail = frame;
+    if (!conn->corked && !conn->want_write)
+        _xpc_connection_flush_locked(conn);
+}
+
+static int _xpc_connection_send(struct xpc_connection *conn, xpc_object_t message, uint32_t flags, uint64_t id) {
+    struct xpc_out_frame *frame = _xpc_connection_make_frame(message, flags, id);
+    if (!frame)
+        return -1;
+    pthread_mutex_lock(&conn->lock);
+    if (conn->closed) {
+        pthread_mutex_unlock(&conn->lock);
+        _xpc_mem_free(frame);
+        errno = ENOTCONN;
+        return -1;
+    }
+    _xpc_connection_enqueue_locked(conn, frame);
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+int xpc_connection_send_message(xpc_connection_t conn, xpc_object_t message) {
+    return _xpc_connection_send(conn, message, 0, 0);
+}
+
+int xpc_connection_send_message_with_reply(xpc_connection_t conn, xpc_object_t message,
+                                           xpc_connection_reply_handler_f handler, void *ctx) {
+    struct xpc_pending_reply *pending;
+    struct xpc_out_frame *frame;
+    uint64_t id;
+    pthread_mutex_lock(&conn->lock);
+    id = conn->next_id++;
+    pthread_mutex_unlock(&conn->lock);
+    frame = _xpc_connection_make_frame(message, XPC_FRAME_WANTS_REPLY, id);
+    if (!frame)
+        return -1;
+    pending = _xpc_mem_alloc(sizeof(struct xpc_pending_reply));
+    pending->id = id;
+    pending->handler = handler;
+    pending->ctx = ctx;
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->closed) {
+        pthread_mutex_unlock(&conn->lock);
+        _xpc_mem_free(frame);
+        _xpc_mem_free(pending);
+        errno = ENOTCONN;
+        return -1;
+    }
+    pending->next = conn->pending[id % XPC_CONNECTION_PENDING_BUCKETS];
+    conn->pending[id % XPC_CONNECTION_PENDING_BUCKETS] = pending;
+    _xpc_connection_enqueue_locked(conn, frame);
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+static void _xpc_sync_reply_handler(void *ctx, xpc_object_t reply) {
+    struct xpc_sync_reply *sync = (struct xpc_sync_reply *) ctx;
+    pthread_mutex_lock(&sync->lock);
+    sync->reply = reply;
+    sync->done = true;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+xpc_object_t xpc_connection_send_message_with_reply_sync(xpc_connection_t conn, xpc_object_t message) {
+    struct xpc_sync_reply sync;
+    pthread_mutex_init(&sync.lock, NULL);
+    pthread_cond_init(&sync.cond, NULL);
+    sync.done = false;
+    sync.reply = NULL;
+    if (xpc_connection_send_message_with_reply(conn, message, _xpc_sync_reply_handler, &sync) == 0) {
+        pthread_mutex_lock(&sync.lock);
+        while (!sync.done)
+            pthread_cond_wait(&sync.cond, &sync.lock);
+        pthread_mutex_unlock(&sync.lock);
+    }
+    pthread_mutex_destroy(&sync.lock);
+    pthread_cond_destroy(&sync.cond);
+    return sync.reply;
+}
+
+static struct xpc_pending_reply *_xpc_connection_take_pending(struct xpc_connection *conn, uint64_t id) {
+    struct xpc_pending_reply **pp, *pending = NULL;
+    pthread_mutex_lock(&conn->lock);
+    for (pp = &conn->pending[id % XPC_CONNECTION_PENDING_BUCKETS]; *pp; pp = &(*pp)->next) {
+        if ((*pp)->id == id) {
+            pending = *pp;
+            *pp = pending->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return pending;
+}
+
+static void _xpc_connection_dispatch_frame(struct xpc_connection *conn, struct xpc_frame_header *hdr,
+                                           xpc_object_t message) {
+    struct xpc_pending_reply *pending;
+    struct xpc_out_frame *frame;
+    xpc_object_t reply;
+    if (hdr->flags & XPC_FRAME_REPLY) {
+        pending = _xpc_connection_take_pending(conn, hdr->id);
+        if (pending) {
+            pending->handler(pending->ctx, message);
+            _xpc_mem_free(pending);
+        } else {
+            xpc_free(message);
+        }
+        return;
+    }
+    if (!conn->listener) {
+        // Client connections only expect replies
+        xpc_free(message);
+        return;
+    }
+    reply = conn->listener->handler(conn->listener->ctx, conn, message);
+    xpc_free(message);
+    if (!(hdr->flags & XPC_FRAME_WANTS_REPLY)) {
+        xpc_free(reply);
+        return;
+    }
+    if (!reply)
+        reply = xpc_dictionary_create(NULL, NULL, 0);
+    frame = _xpc_connection_make_frame(reply, XPC_FRAME_REPLY, hdr->id);
+    xpc_free(reply);
+    if (frame) {
+        pthread_mutex_lock(&conn->lock);
+        _xpc_connection_enqueue_locked(conn, frame);
+        pthread_mutex_unlock(&conn->lock);
+    }
+}
+
+/* Called when the buffer is full, which means it holds the start of a frame larger than the buffer. The buffer only
+ * grows as the frame's data arrives, a header alone doesn't reserve the size it announces. */
+static bool _xpc_connection_grow_rbuf(struct xpc_connection *conn) {
+    struct xpc_frame_header hdr;
+    size_t size = conn->rbuf_size * 2;
+    uint8_t *rbuf;
+    memcpy(&hdr, conn->rbuf, sizeof(hdr));
+    if (size > sizeof(hdr) + hdr.size)
+        size = sizeof(hdr) + hdr.size;
+    if (size <= conn->rbuf_size || !(rbuf = _xpc_mem_realloc(conn->rbuf, size)))
+        return false;
+    conn->rbuf = rbuf;
+    conn->rbuf_size = size;
+    return true;
+}
+
+/* Returns false if the stream is corrupt and the connection has to be dropped. */
+static bool _xpc_connection_process_input(struct xpc_connection *conn) {
+    struct xpc_frame_header hdr;
+    xpc_object_t message;
+    size_t off = 0;
+    bool ok = true;
+
+    pthread_mutex_lock(&conn->lock);
+    conn->corked = true;
+    pthread_mutex_unlock(&conn->lock);
+
+    while (conn->rbuf_len - off >= sizeof(struct xpc_frame_header)) {
+        memcpy(&hdr, &conn->rbuf[off], sizeof(hdr));
+        if (hdr.size > XPC_FRAME_MAX_SIZE) {
+            ok = false;
+            break;
+        }
+        if (conn->rbuf_len - off - sizeof(hdr) < hdr.size)
+            break;
+        message = xpc_deserialize(&conn->rbuf[off + sizeof(hdr)], hdr.size);
+        off += sizeof(hdr) + hdr.size;
+        if (!message) {
+            ok = false;
+            break;
+        }
+        _xpc_connection_dispatch_frame(conn, &hdr, message);
+    }
+    if (off > 0) {
+        memmove(conn->rbuf, &conn->rbuf[off], conn->rbuf_len - off);
+        conn->rbuf_len -= off;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    conn->corked = false;
+    if (!conn->want_write)
+        _xpc_connection_flush_locked(conn);
+    pthread_mutex_unlock(&conn->lock);
+    return ok;
+}
+
+/* Called on the owning thread with conn->lock held. Releases the lock; peers without a queued close request drop the
+ * reference they hold while open. */
+static void _xpc_connection_close(struct xpc_connection *conn) {
+    struct xpc_pending_reply *pending = NULL, *p, *next;
+    struct xpc_out_frame *frame, *next_frame;
+    struct xpc_listener *listener = conn->listener;
+    xpc_connection_close_handler_f close_handler = conn->close_handler;
+    void *close_ctx = conn->close_ctx;
+    size_t i;
+    bool free_conn = false;
+
+    if (conn->io.fd >= 0)
+        _xpc_io_remove(&conn->io);
+    conn->closed = true;
+    for (frame = conn->out_head; frame; frame = next_frame) {
+        next_frame = frame->next;
+        _xpc_mem_free(frame);
+    }
+    conn->out_head = conn->out_tail = NULL;
+    for (i = 0; i < XPC_CONNECTION_PENDING_BUCKETS; i++) {
+        for (p = conn->pending[i]; p; p = next) {
+            next = p->next;
+            p->next = pending;
+            pending = p;
+        }
+        conn->pending[i] = NULL;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    for (p = pending; p; p = next) {
+        next = p->next;
+        p->handler(p->ctx, NULL);
+        _xpc_mem_free(p);
+    }
+    if (close_handler)
+        close_handler(close_ctx, conn);
+
+    if (listener) {
+        // A queued close request owns the peer from now on and frees it once processed
+        pthread_mutex_lock(&listener->lock);
+        if (!conn->close_posted) {
+            if (conn->peer_prev)
+                conn->peer_prev->peer_next = conn->peer_next;
+            else
+                listener->peers = conn->peer_next;
+            if (conn->peer_next)
+                conn->peer_next->peer_prev = conn->peer_prev;
+            pthread_cond_broadcast(&listener->cond);
+            free_conn = true;
+        }
+        pthread_mutex_unlock(&listener->lock);
+        if (free_conn)
+            xpc_connection_release(conn);
+    }
+}
+
+static void _xpc_connection_on_close_request(struct xpc_io *io) {
+    struct xpc_connection *conn = (struct xpc_connection *) io;
+    struct xpc_listener *listener = conn->listener;
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->closed)
+        _xpc_connection_close(conn);
+    else
+        pthread_mutex_unlock(&conn->lock);
+    if (!listener) {
+        // The owner of a client connection waits for this in xpc_connection_free
+        pthread_mutex_lock(&conn->lock);
+        conn->released = true;
+        pthread_cond_broadcast(&conn->cond);
+        pthread_mutex_unlock(&conn->lock);
+    } else {
+        pthread_mutex_lock(&listener->lock);
+        if (conn->peer_prev)
+            conn->peer_prev->peer_next = conn->peer_next;
+        else
+            listener->peers = conn->peer_next;
+        if (conn->peer_next)
+            conn->peer_next->peer_prev = conn->peer_prev;
+        pthread_cond_broadcast(&listener->cond);
+        pthread_mutex_unlock(&listener->lock);
+        xpc_connection_release(conn);
+    }
+}
+
+static void _xpc_connection_on_event(struct xpc_io *io, uint32_t events) {
+    struct xpc_connection *conn = (struct xpc_connection *) io;
+    ssize_t n;
+    if (events & EPOLLOUT) {
+        pthread_mutex_lock(&conn->lock);
+        _xpc_connection_flush_locked(conn);
+        pthread_mutex_unlock(&conn->lock);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+    if (conn->rbuf_len == conn->rbuf_size && !_xpc_connection_grow_rbuf(conn)) {
+        pthread_mutex_lock(&conn->lock);
+        _xpc_connection_close(conn);
+        return;
+    }
+    n = read(io->fd, &conn->rbuf[conn->rbuf_len], conn->rbuf_size - conn->rbuf_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n > 0) {
+        conn->rbuf_len += n;
+        if (_xpc_connection_process_input(conn))
+            return;
+    }
+    pthread_mutex_lock(&conn->lock);
+    _xpc_connection_close(conn);
+}
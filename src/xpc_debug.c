@@ -70,21 +70,20 @@ static void _xpc_debug_print_array(xpc_object_t obj, xpc_debug_write out) {
 
 static void _xpc_debug_print_dict(xpc_object_t obj, xpc_debug_write out) {
     struct xpc_dict *dict = (struct xpc_dict *) obj;
-    int i;
-    struct xpc_dict_el *el;
+    size_t i;
+    struct xpc_dict_entry *e;
     out("{");
     bool first = true;
-    for (i = 0; i < XPC_DICT_NBUCKETS; ++i) {
-        el = dict->buckets[i];
-        while (el) {
-            if (!first)
-                out(", ");
-            first = false;
-            out(el->key);
-            out(": ");
-            xpc_debug_print(el->value, out);
-            el = el->next;
-        }
+    for (i = 0; i < dict->used; ++i) {
+        e = &dict->entries[i];
+        if (!e->value)
+            continue;
+        if (!first)
+            out(", ");
+        first = false;
+        out(e->key);
+        out(": ");
+        xpc_debug_print(e->value, out);
     }
     out("}");
 }
@@ -0,0 +1,294 @@
+#include <xpc/xpc.h>
+#include "xpc_internal.h"
+#include <string.h>
+
+#define XPC_HASH_M 0x9e3779b97f4a7c15ULL
+#define XPC_HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define XPC_INTERN_INITIAL_SIZE 64
+
+static uint64_t _xpc_hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t _xpc_hash_bytes(uint64_t seed, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t h = seed ^ (len * XPC_HASH_M);
+    uint64_t k;
+    while (len >= sizeof(uint64_t)) {
+        memcpy(&k, p, sizeof(uint64_t));
+        h ^= _xpc_hash_mix(k);
+        h = XPC_HASH_ROTL(h, 27) * XPC_HASH_M;
+        p += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    if (len > 0) {
+        k = 0;
+        memcpy(&k, p, len);
+        h ^= _xpc_hash_mix(k);
+    }
+    return _xpc_hash_mix(h);
+}
+
+uint64_t _xpc_hash_leaf(xpc_type_t type, const void *data, size_t len) {
+    return _xpc_hash_bytes((uint64_t) type * XPC_HASH_M, data, len);
+}
+
+uint64_t _xpc_hash_array_begin(size_t count) {
+    return _xpc_hash_mix((uint64_t) XPC_ARRAY * XPC_HASH_M ^ count);
+}
+
+uint64_t _xpc_hash_array_add(uint64_t h, uint64_t el_hash) {
+    return _xpc_hash_mix(XPC_HASH_ROTL(h, 31) ^ el_hash) * XPC_HASH_M;
+}
+
+uint64_t _xpc_hash_dict_entry(const char *key, size_t key_length, uint64_t value_hash) {
+    return _xpc_hash_mix(_xpc_hash_bytes(0, key, key_length) ^ (value_hash * XPC_HASH_M));
+}
+
+uint64_t _xpc_hash_dict_finish(size_t count, uint64_t entries_sum) {
+    return _xpc_hash_mix(entries_sum + _xpc_hash_mix((uint64_t) XPC_DICTIONARY * XPC_HASH_M ^ count));
+}
+
+static uint64_t *_xpc_hash_field(struct xpc_value *v) {
+    switch (v->type) {
+        case XPC_DATA:
+        case XPC_STRING:
+            return &((struct xpc_value_varlen *) v)->hash;
+        case XPC_DICTIONARY:
+            return &((struct xpc_dict *) v)->hash;
+        case XPC_ARRAY:
+            return &((struct xpc_array *) v)->hash;
+        default:
+            return NULL;
+    }
+}
+
+static bool _xpc_hash_cached(struct xpc_value *v, uint64_t *hash) {
+    uint64_t *field = _xpc_hash_field(v);
+    if (!field || !(__atomic_load_n(&v->flags, __ATOMIC_ACQUIRE) & XPC_FLAG_HASHED))
+        return false;
+    *hash = *field;
+    return true;
+}
+
+static void _xpc_hash_store(struct xpc_value *v, uint64_t hash) {
+    uint64_t *field = _xpc_hash_field(v);
+    if (!field)
+        return;
+    *field = hash;
+    __atomic_or_fetch(&v->flags, XPC_FLAG_HASHED, __ATOMIC_RELEASE);
+}
+
+static uint64_t _xpc_hash_compute(struct xpc_value *v) {
+    struct xpc_value_varlen *vl;
+    struct xpc_array *arr;
+    struct xpc_dict *dict;
+    struct xpc_dict_entry *e;
+    uint64_t h;
+    uint8_t b;
+    size_t i;
+    switch (v->type) {
+        case XPC_BOOL:
+            b = XPC_VALUE(v, bool) ? 1 : 0;
+            return _xpc_hash_leaf(XPC_BOOL, &b, sizeof(b));
+        case XPC_INT64:
+        case XPC_UINT64:
+        case XPC_DOUBLE:
+            return _xpc_hash_leaf(v->type, v->value, sizeof(uint64_t));
+        case XPC_UUID:
+            return _xpc_hash_leaf(XPC_UUID, v->value, sizeof(unsigned char[16]));
+        case XPC_DATA:
+            vl = (struct xpc_value_varlen *) v;
+            return _xpc_hash_leaf(XPC_DATA, vl->value, vl->size);
+        case XPC_STRING:
+            vl = (struct xpc_value_varlen *) v;
+            return _xpc_hash_leaf(XPC_STRING, vl->value, vl->size - 1);
+        case XPC_ARRAY:
+            arr = (struct xpc_array *) v;
+            h = _xpc_hash_array_begin(arr->count);
+            for (i = 0; i < arr->count; i++)
+                h = _xpc_hash_array_add(h, xpc_hash(arr->value[i]));
+            return h;
+        case XPC_DICTIONARY:
+            dict = (struct xpc_dict *) v;
+            h = 0;
+            for (i = 0; i < dict->used; ++i) {
+                e = &dict->entries[i];
+                if (e->value)
+                    h += _xpc_hash_dict_entry(e->key, e->key_length, xpc_hash(e->value));
+            }
+            return _xpc_hash_dict_finish(dict->count, h);
+        default:
+            return _xpc_hash_leaf(v->type, NULL, 0);
+    }
+}
+
+uint64_t xpc_hash(xpc_object_t obj) {
+    struct xpc_value *v = (struct xpc_value *) obj;
+    uint64_t h;
+    if (_xpc_hash_cached(v, &h))
+        return h;
+    h = _xpc_hash_compute(v);
+    // Containers are mutable, so their hash may only be cached once they have been frozen by interning
+    if (v->type == XPC_DATA || v->type == XPC_STRING || (v->flags & XPC_FLAG_INTERNED))
+        _xpc_hash_store(v, h);
+    return h;
+}
+
+static bool _xpc_dictionary_equal(struct xpc_dict *a, struct xpc_dict *b) {
+    size_t i;
+    struct xpc_dict_entry *e, *be;
+    for (i = 0; i < a->used; ++i) {
+        e = &a->entries[i];
+        if (!e->value)
+            continue;
+        be = _xpc_dictionary_find_entry(b, e->key, e->hash);
+        if (!be || !xpc_equal(e->value, be->value))
+            return false;
+    }
+    return true;
+}
+
+bool xpc_equal(xpc_object_t a, xpc_object_t b) {
+    struct xpc_value *va = (struct xpc_value *) a, *vb = (struct xpc_value *) b;
+    struct xpc_value_varlen *la, *lb;
+    struct xpc_array *arr_a, *arr_b;
+    uint64_t ha, hb;
+    size_t i;
+    if (a == b)
+        return true;
+    if (!a || !b || va->type != vb->type)
+        return false;
+    if (_xpc_hash_cached(va, &ha) && _xpc_hash_cached(vb, &hb) && ha != hb)
+        return false;
+    switch (va->type) {
+        case XPC_BOOL:
+            return XPC_VALUE(va, bool) == XPC_VALUE(vb, bool);
+        case XPC_INT64:
+        case XPC_UINT64:
+        case XPC_DOUBLE:
+            // Doubles are compared bitwise to stay consistent with xpc_hash
+            return memcmp(va->value, vb->value, sizeof(uint64_t)) == 0;
+        case XPC_UUID:
+            return memcmp(va->value, vb->value, sizeof(unsigned char[16])) == 0;
+        case XPC_DATA:
+        case XPC_STRING:
+            la = (struct xpc_value_varlen *) a;
+            lb = (struct xpc_value_varlen *) b;
+            return la->size == lb->size && memcmp(la->value, lb->value, la->size) == 0;
+        case XPC_ARRAY:
+            arr_a = (struct xpc_array *) a;
+            arr_b = (struct xpc_array *) b;
+            if (arr_a->count != arr_b->count)
+                return false;
+            for (i = 0; i < arr_a->count; i++) {
+                if (!xpc_equal(arr_a->value[i], arr_b->value[i]))
+                    return false;
+            }
+            return true;
+        case XPC_DICTIONARY:
+            if (((struct xpc_dict *) a)->count != ((struct xpc_dict *) b)->count)
+                return false;
+            return _xpc_dictionary_equal((struct xpc_dict *) a, (struct xpc_dict *) b);
+        default:
+            return true;
+    }
+}
+
+struct xpc_intern_slot {
+    uint64_t hash;
+    xpc_object_t obj;
+};
+struct xpc_intern_cache {
+    size_t count, size;
+    struct xpc_intern_slot *slots;
+};
+
+xpc_intern_cache_t xpc_intern_cache_create(void) {
+    struct xpc_intern_cache *cache = _xpc_mem_alloc(sizeof(struct xpc_intern_cache));
+    cache->count = 0;
+    cache->size = XPC_INTERN_INITIAL_SIZE;
+    cache->slots = _xpc_mem_calloc(cache->size, sizeof(struct xpc_intern_slot));
+    return cache;
+}
+
+void xpc_intern_cache_free(xpc_intern_cache_t cache) {
+    size_t i;
+    if (!cache)
+        return;
+    for (i = 0; i < cache->size; i++) {
+        // Children of an interned container are interned themselves and are released through their own slot
+        if (cache->slots[i].obj)
+            _xpc_free_object(cache->slots[i].obj, false);
+    }
+    _xpc_mem_free(cache->slots);
+    _xpc_mem_free(cache);
+}
+
+size_t xpc_intern_cache_get_count(xpc_intern_cache_t cache) {
+    return cache->count;
+}
+
+static void _xpc_intern_cache_grow(struct xpc_intern_cache *cache) {
+    struct xpc_intern_slot *old_slots = cache->slots;
+    size_t old_size = cache->size, i, j;
+    cache->size *= 2;
+    cache->slots = _xpc_mem_calloc(cache->size, sizeof(struct xpc_intern_slot));
+    for (i = 0; i < old_size; i++) {
+        if (!old_slots[i].obj)
+            continue;
+        j = old_slots[i].hash & (cache->size - 1);
+        while (cache->slots[j].obj)
+            j = (j + 1) & (cache->size - 1);
+        cache->slots[j] = old_slots[i];
+    }
+    _xpc_mem_free(old_slots);
+}
+
+xpc_object_t xpc_intern(xpc_intern_cache_t cache, xpc_object_t obj) {
+    struct xpc_value *v = (struct xpc_value *) obj;
+    struct xpc_array *arr;
+    struct xpc_dict *dict;
+    struct xpc_dict_entry *e;
+    uint64_t h;
+    size_t i;
+    if (!obj || (v->flags & XPC_FLAG_INTERNED))
+        return obj;
+
+    if (v->type == XPC_ARRAY) {
+        arr = (struct xpc_array *) obj;
+        for (i = 0; i < arr->count; i++)
+            arr->value[i] = xpc_intern(cache, arr->value[i]);
+    } else if (v->type == XPC_DICTIONARY) {
+        dict = (struct xpc_dict *) obj;
+        for (i = 0; i < dict->used; ++i) {
+            e = &dict->entries[i];
+            if (e->value)
+                e->value = xpc_intern(cache, e->value);
+        }
+    }
+
+    h = xpc_hash(obj);
+    i = h & (cache->size - 1);
+    while (cache->slots[i].obj) {
+        if (cache->slots[i].hash == h && xpc_equal(cache->slots[i].obj, obj)) {
+            xpc_free(obj);
+            return cache->slots[i].obj;
+        }
+        i = (i + 1) & (cache->size - 1);
+    }
+
+    v->flags |= XPC_FLAG_INTERNED;
+    _xpc_hash_store(v, h);
+    cache->slots[i].hash = h;
+    cache->slots[i].obj = obj;
+    if (++cache->count * 4 > cache->size * 3)
+        _xpc_intern_cache_grow(cache);
+    return obj;
+}
@@ -2,40 +2,140 @@
 #define XPC_INTERNAL_H
 
 #include <xpc/xpc.h>
+#include <string.h>
+
+#define XPC_FLAG_HASHED 1 /* hash field holds the cached structural hash */
+#define XPC_FLAG_INTERNED 2 /* owned by an intern cache; immutable, xpc_free is a no-op */
 
 struct xpc_value {
     enum xpc_value_type type;
+    uint32_t flags;
     char value[];
 };
 #define XPC_VALUE(v, type) (*((type *) v->value))
 
 struct xpc_value_varlen {
     enum xpc_value_type type;
+    uint32_t flags;
     size_t size;
+    uint64_t hash;
     char value[];
 };
 
-#define XPC_DICT_NBUCKETS 8
-#define XPC_DICT_BUCKET(hash) (hash % XPC_DICT_NBUCKETS)
+#define XPC_DICT_MIN_INDEX_SIZE 8
+#define XPC_DICT_USABLE(index_size) ((index_size) * 2 / 3)
+#define XPC_DICT_IX_EMPTY UINT32_MAX
+#define XPC_DICT_IX_DUMMY (UINT32_MAX - 1)
+#define XPC_DICT_INDEX_BYTES(index_size) \
+    ((index_size) * sizeof(uint32_t) + XPC_DICT_USABLE(index_size) * sizeof(struct xpc_dict_entry))
 
-struct xpc_dict_el;
-struct xpc_dict {
-    enum xpc_value_type type;
-    size_t count;
-    struct xpc_dict_el *buckets[XPC_DICT_NBUCKETS];
-};
-struct xpc_dict_el {
+/* Entries are kept in insertion order; removed entries stay behind with a NULL value until the next resize. */
+struct xpc_dict_entry {
     unsigned long hash;
     xpc_object_t value;
-    struct xpc_dict_el *prev, *next;
     size_t key_length;
-    char key[];
+    char *key;
+};
+struct xpc_dict {
+    enum xpc_value_type type;
+    uint32_t flags;
+    size_t count, used;
+    size_t index_size;
+    uint64_t hash;
+    struct xpc_dict_entry **sorted; /* entries in key order, built lazily and dropped when keys change */
+    uint32_t *index; /* open addressing table of entry positions, shares its allocation with entries */
+    struct xpc_dict_entry *entries;
 };
 
 struct xpc_array {
     enum xpc_value_type type;
+    uint32_t flags;
     size_t count, mem_count;
+    uint64_t hash;
     xpc_object_t **value;
 };
 
+extern struct xpc_allocator _xpc_allocator;
+
+static inline void *_xpc_mem_alloc(size_t size) {
+    return _xpc_allocator.malloc(_xpc_allocator.ctx, size);
+}
+static inline void *_xpc_mem_calloc(size_t count, size_t size) {
+    void *ret = _xpc_allocator.malloc(_xpc_allocator.ctx, count * size);
+    memset(ret, 0, count * size);
+    return ret;
+}
+static inline void *_xpc_mem_realloc(void *ptr, size_t size) {
+    return _xpc_allocator.realloc(_xpc_allocator.ctx, ptr, size);
+}
+static inline void _xpc_mem_free(void *ptr) {
+    if (ptr)
+        _xpc_allocator.free(_xpc_allocator.ctx, ptr);
+}
+
+#ifdef XPC_ENABLE_STATS
+void _xpc_stats_object(xpc_type_t type, size_t bytes, bool alloc);
+void _xpc_stats_bytes(xpc_type_t type, size_t bytes, bool alloc);
+void _xpc_stats_dict_probe(size_t probes);
+uint64_t _xpc_stats_now(void);
+void _xpc_stats_serialize(size_t bytes, uint64_t start);
+void _xpc_stats_deserialize(size_t bytes, uint64_t start);
+
+#define XPC_STATS_OBJECT_ALLOC(type, bytes) _xpc_stats_object(type, bytes, true)
+#define XPC_STATS_OBJECT_FREE(type, bytes) _xpc_stats_object(type, bytes, false)
+#define XPC_STATS_BYTES_ALLOC(type, bytes) _xpc_stats_bytes(type, bytes, true)
+#define XPC_STATS_BYTES_FREE(type, bytes) _xpc_stats_bytes(type, bytes, false)
+#define XPC_STATS_DICT_PROBE(probes) _xpc_stats_dict_probe(probes)
+#define XPC_STATS_TIME_BEGIN(var) uint64_t var = _xpc_stats_now()
+#define XPC_STATS_SERIALIZE(bytes, start) _xpc_stats_serialize(bytes, start)
+#define XPC_STATS_DESERIALIZE(bytes, start) _xpc_stats_deserialize(bytes, start)
+#else
+#define XPC_STATS_OBJECT_ALLOC(type, bytes) ((void) 0)
+#define XPC_STATS_OBJECT_FREE(type, bytes) ((void) 0)
+#define XPC_STATS_BYTES_ALLOC(type, bytes) ((void) 0)
+#define XPC_STATS_BYTES_FREE(type, bytes) ((void) 0)
+#define XPC_STATS_DICT_PROBE(probes) ((void) 0)
+#define XPC_STATS_TIME_BEGIN(var) ((void) 0)
+#define XPC_STATS_SERIALIZE(bytes, start) ((void) 0)
+#define XPC_STATS_DESERIALIZE(bytes, start) ((void) 0)
+#endif
+
+void _xpc_free_object(xpc_object_t obj, bool recursive);
+
+/* Wire format */
+typedef uint32_t xpc_s_type_t;
+
+#define XPC_BIN_MAGIC 0x42133742
+#define XPC_BIN_VERSION 5
+
+#define XPC_SERIALIZE_CANONICAL 1
+
+#define XPC_DATA_PAD_SIZE(len) (((len) + 3) / 4 * 4)
+#define XPC_SERIALIZED_TYPE(typ) (typ << 12)
+
+#define XPC_WRITE(type, value) *((type *) buf) = value; buf += sizeof(type);
+#define XPC_COPY_PADDED(data, len) \
+    memcpy(buf, (data), (len)); \
+    memset(&buf[len], 0, XPC_DATA_PAD_SIZE(len) - (len)); \
+    buf += XPC_DATA_PAD_SIZE(len);
+#define XPC_READ(type) ({ off += sizeof(type); off <= len ? *((type *) (&buf[off - sizeof(type)])) : 0; })
+
+size_t _xpc_serialized_size(xpc_object_t obj);
+size_t _xpc_serialize(xpc_object_t o, uint8_t *buf, int flags);
+xpc_object_t _xpc_deserialize(const uint8_t *buf, size_t *offp, size_t len);
+size_t _xpc_serialized_skip(const uint8_t *buf, size_t off, size_t len);
+
+unsigned long _xpc_dictionary_hash_key(const char *str);
+void _xpc_dictionary_reserve(xpc_object_t obj, size_t count);
+struct xpc_dict_entry *_xpc_dictionary_find_entry(xpc_object_t obj, const char *key, unsigned long key_hash);
+struct xpc_dict_entry **_xpc_dictionary_sorted(xpc_object_t obj);
+
+/* Structural hash building blocks, shared by the in-memory and the serialized representation. */
+uint64_t _xpc_hash_bytes(uint64_t seed, const void *data, size_t len);
+uint64_t _xpc_hash_leaf(xpc_type_t type, const void *data, size_t len);
+uint64_t _xpc_hash_array_begin(size_t count);
+uint64_t _xpc_hash_array_add(uint64_t h, uint64_t el_hash);
+uint64_t _xpc_hash_dict_entry(const char *key, size_t key_length, uint64_t value_hash);
+uint64_t _xpc_hash_dict_finish(size_t count, uint64_t entries_sum);
+
 #endif //XPC_INTERNAL_H
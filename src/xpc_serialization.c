@@ -3,18 +3,10 @@
 #include <string.h>
 #include <stdio.h>
 
-typedef uint32_t xpc_s_type_t;
-
-#define XPC_BIN_MAGIC 0x42133742
-#define XPC_BIN_VERSION 5
-
-#define XPC_DATA_PAD_SIZE(len) (((len) + 3) / 4 * 4)
-#define XPC_SERIALIZED_TYPE(typ) (typ << 12)
-
 static size_t _xpc_dictionary_serialized_size(xpc_object_t obj);
 static size_t _xpc_array_serialized_size(xpc_object_t obj);
 
-static size_t _xpc_serialized_size(xpc_object_t obj) {
+size_t _xpc_serialized_size(xpc_object_t obj) {
     struct xpc_value *v = (struct xpc_value *) obj;
     switch (v->type) {
         case XPC_BOOL:
@@ -29,6 +21,8 @@ static size_t _xpc_serialized_size(xpc_object_t obj) {
             return sizeof(xpc_s_type_t) + sizeof(int32_t) + XPC_DATA_PAD_SIZE(xpc_data_get_length(obj));
         case XPC_STRING:
             return sizeof(xpc_s_type_t) + sizeof(int32_t) + XPC_DATA_PAD_SIZE(xpc_string_get_length(obj) + 1);
+        case XPC_UUID:
+            return sizeof(xpc_s_type_t) + sizeof(unsigned char[16]);
         case XPC_DICTIONARY:
             return _xpc_dictionary_serialized_size(obj);
         case XPC_ARRAY:
@@ -41,15 +35,14 @@ static size_t _xpc_serialized_size(xpc_object_t obj) {
 static size_t _xpc_dictionary_serialized_size(xpc_object_t obj) {
     size_t ret = sizeof(xpc_s_type_t) + sizeof(uint32_t) * 2;
     struct xpc_dict *dict = (struct xpc_dict *) obj;
-    int i;
-    struct xpc_dict_el *el;
-    for (i = 0; i < XPC_DICT_NBUCKETS; ++i) {
-        el = dict->buckets[i];
-        while (el) {
-            ret += XPC_DATA_PAD_SIZE(el->key_length + 1);
-            ret += _xpc_serialized_size(el->value);
-            el = el->next;
-        }
+    size_t i;
+    struct xpc_dict_entry *e;
+    for (i = 0; i < dict->used; ++i) {
+        e = &dict->entries[i];
+        if (!e->value)
+            continue;
+        ret += XPC_DATA_PAD_SIZE(e->key_length + 1);
+        ret += _xpc_serialized_size(e->value);
     }
     return ret;
 }
@@ -67,16 +60,10 @@ size_t xpc_serialized_size(xpc_object_t obj) {
     return _xpc_serialized_size(obj) + sizeof(uint32_t) * 2;
 }
 
-#define XPC_WRITE(type, value) *((type *) buf) = value; buf += sizeof(type);
-#define XPC_COPY_PADDED(data, len) \
-    memcpy(buf, (data), (len)); \
-    memset(&buf[len], 0, XPC_DATA_PAD_SIZE(len) - (len)); \
-    buf += XPC_DATA_PAD_SIZE(len);
-
-static size_t _xpc_dictionary_serialize(xpc_object_t obj, uint8_t *buf);
-static size_t _xpc_array_serialize(xpc_object_t obj, uint8_t *buf);
+static size_t _xpc_dictionary_serialize(xpc_object_t obj, uint8_t *buf, int flags);
+static size_t _xpc_array_serialize(xpc_object_t obj, uint8_t *buf, int flags);
 
-static size_t _xpc_serialize(xpc_object_t o, uint8_t *buf) {
+size_t _xpc_serialize(xpc_object_t o, uint8_t *buf, int flags) {
     size_t len;
     uint8_t *const buf_i = buf;
     struct xpc_value *v = (struct xpc_value *) o;
@@ -100,50 +87,62 @@ static size_t _xpc_serialize(xpc_object_t o, uint8_t *buf) {
         case XPC_DATA:
             XPC_WRITE(xpc_s_type_t, XPC_SERIALIZED_TYPE(XPC_DATA))
             len = xpc_data_get_length(o);
+            XPC_WRITE(uint32_t, len)
             XPC_COPY_PADDED(xpc_data_get_bytes_ptr(o), len)
             break;
         case XPC_STRING:
             XPC_WRITE(xpc_s_type_t, XPC_SERIALIZED_TYPE(XPC_STRING))
-            len = xpc_string_get_length(o);
+            len = xpc_string_get_length(o) + 1;
+            XPC_WRITE(uint32_t, len)
             XPC_COPY_PADDED(xpc_string_get_string_ptr(o), len)
             break;
         case XPC_UUID:
             XPC_WRITE(xpc_s_type_t, XPC_SERIALIZED_TYPE(XPC_UUID))
             memcpy(buf, xpc_uuid_get_bytes(o), sizeof(unsigned char[16]));
             buf += sizeof(unsigned char[16]);
+            break;
         case XPC_DICTIONARY:
-            return _xpc_dictionary_serialize(o, buf);
+            return _xpc_dictionary_serialize(o, buf, flags);
         case XPC_ARRAY:
-            return _xpc_array_serialize(o, buf);
+            return _xpc_array_serialize(o, buf, flags);
         default:
             break;
     }
     return buf - buf_i;
 }
 
-static size_t _xpc_dictionary_serialize(xpc_object_t obj, uint8_t *buf) {
+static size_t _xpc_dictionary_serialize(xpc_object_t obj, uint8_t *buf, int flags) {
     uint8_t *const buf_i = buf;
     uint32_t *size_ptr;
     struct xpc_dict *dict = (struct xpc_dict *) obj;
-    int i;
-    struct xpc_dict_el *el;
+    struct xpc_dict_entry **sorted;
+    size_t i;
+    struct xpc_dict_entry *e;
     XPC_WRITE(xpc_s_type_t, XPC_SERIALIZED_TYPE(XPC_DICTIONARY))
     size_ptr = (uint32_t *) buf;
     XPC_WRITE(uint32_t, 0)
     XPC_WRITE(uint32_t, dict->count)
-    for (i = 0; i < XPC_DICT_NBUCKETS; ++i) {
-        el = dict->buckets[i];
-        while (el) {
-            XPC_COPY_PADDED(el->key, el->key_length + 1)
-            buf += _xpc_serialize(el->value, buf);
-            el = el->next;
+    if (flags & XPC_SERIALIZE_CANONICAL) {
+        sorted = _xpc_dictionary_sorted(obj);
+        for (i = 0; i < dict->count; ++i) {
+            e = sorted[i];
+            XPC_COPY_PADDED(e->key, e->key_length + 1)
+            buf += _xpc_serialize(e->value, buf, flags);
+        }
+    } else {
+        for (i = 0; i < dict->used; ++i) {
+            e = &dict->entries[i];
+            if (!e->value)
+                continue;
+            XPC_COPY_PADDED(e->key, e->key_length + 1)
+            buf += _xpc_serialize(e->value, buf, flags);
         }
     }
     *size_ptr = buf - (uint8_t *) (size_ptr + 1);
     return buf - buf_i;
 }
 
-static size_t _xpc_array_serialize(xpc_object_t obj, uint8_t *buf) {
+static size_t _xpc_array_serialize(xpc_object_t obj, uint8_t *buf, int flags) {
     uint8_t *const buf_i = buf;
     uint32_t *size_ptr;
     struct xpc_array *arr = (struct xpc_array *) obj;
@@ -153,23 +152,33 @@ static size_t _xpc_array_serialize(xpc_object_t obj, uint8_t *buf) {
     XPC_WRITE(uint32_t, 0)
     XPC_WRITE(uint32_t, arr->count)
     for (i = 0; i < arr->count; ++i)
-        buf += _xpc_serialize(arr->value[i], buf);
+        buf += _xpc_serialize(arr->value[i], buf, flags);
     *size_ptr = buf - (uint8_t *) (size_ptr + 1);
     return buf - buf_i;
 }
 
-size_t xpc_serialize(xpc_object_t o, uint8_t *buf) {
+static size_t _xpc_serialize_message(xpc_object_t o, uint8_t *buf, int flags) {
+    XPC_STATS_TIME_BEGIN(start);
+    size_t ret;
     XPC_WRITE(uint32_t, XPC_BIN_MAGIC);
     XPC_WRITE(uint32_t, XPC_BIN_VERSION);
-    return _xpc_serialize(o, buf) + sizeof(__uint32_t) * 2;
+    ret = _xpc_serialize(o, buf, flags) + sizeof(__uint32_t) * 2;
+    XPC_STATS_SERIALIZE(ret, start);
+    return ret;
 }
 
-#define XPC_READ(type) ({ off += sizeof(type); off <= len ? *((type *) (&buf[off - sizeof(type)])) : 0; })
+size_t xpc_serialize(xpc_object_t o, uint8_t *buf) {
+    return _xpc_serialize_message(o, buf, 0);
+}
+
+size_t xpc_serialize_canonical(xpc_object_t o, uint8_t *buf) {
+    return _xpc_serialize_message(o, buf, XPC_SERIALIZE_CANONICAL);
+}
 
 static xpc_object_t _xpc_deserialize_dictionary(const uint8_t *buf, size_t *offp, size_t len);
 static xpc_object_t _xpc_deserialize_array(const uint8_t *buf, size_t *offp, size_t len);
 
-static xpc_object_t _xpc_deserialize(const uint8_t *buf, size_t *offp, size_t len) {
+xpc_object_t _xpc_deserialize(const uint8_t *buf, size_t *offp, size_t len) {
     size_t tlen, off = *offp;
     xpc_object_t ret = NULL;
     xpc_s_type_t type;
@@ -217,7 +226,7 @@ static xpc_object_t _xpc_deserialize(const uint8_t *buf, size_t *offp, size_t le
 
 static xpc_object_t _xpc_deserialize_dictionary(const uint8_t *buf, size_t *offp, size_t len) {
     size_t off = *offp;
-    size_t r_size, r_cnt, m_len, key_size;
+    size_t r_size, r_cnt, m_len, key_size, avail;
     char *key;
     xpc_object_t ret, val;
     ret = xpc_dictionary_create(NULL, NULL, 0);
@@ -226,7 +235,10 @@ static xpc_object_t _xpc_deserialize_dictionary(const uint8_t *buf, size_t *offp
     if (len > m_len)
         len = m_len;
     r_cnt = XPC_READ(uint32_t);
-    while (r_cnt--) {
+    // The count comes off the wire, every entry takes at least a padded key and a type word
+    avail = off < len ? (len - off) / 8 : 0;
+    _xpc_dictionary_reserve(ret, r_cnt < avail ? r_cnt : avail);
+    while (r_cnt-- && off < len) {
         key = (char *) &buf[off];
         key_size = strnlen(key, len - off);
         off += XPC_DATA_PAD_SIZE(key_size + 1);
@@ -239,15 +251,16 @@ static xpc_object_t _xpc_deserialize_dictionary(const uint8_t *buf, size_t *offp
 
 static xpc_object_t _xpc_deserialize_array(const uint8_t *buf, size_t *offp, size_t len) {
     size_t off = *offp;
-    size_t size, r_cnt, m_len;
+    size_t size, r_cnt, m_len, avail;
     xpc_object_t ret, val;
     size = XPC_READ(uint32_t);
     m_len = off + size;
     if (len > m_len)
         len = m_len;
     r_cnt = XPC_READ(uint32_t);
-    ret = xpc_array_create_preallocated(r_cnt);
-    while (r_cnt--) {
+    avail = off < len ? (len - off) / sizeof(xpc_s_type_t) : 0;
+    ret = xpc_array_create_preallocated(r_cnt < avail ? r_cnt : avail);
+    while (r_cnt-- && off < len) {
         val = _xpc_deserialize(buf, &off, len);
         xpc_array_append_value(ret, val);
     }
@@ -256,10 +269,118 @@ static xpc_object_t _xpc_deserialize_array(const uint8_t *buf, size_t *offp, siz
 }
 
 xpc_object_t xpc_deserialize(const uint8_t *buf, size_t len) {
+    XPC_STATS_TIME_BEGIN(start);
     size_t off = 0;
+    xpc_object_t ret;
     uint32_t magic = XPC_READ(uint32_t);
     uint32_t version = XPC_READ(uint32_t);
     if (magic != XPC_BIN_MAGIC || version != XPC_BIN_VERSION)
         return NULL;
-    return _xpc_deserialize(buf, &off, len);
-}
\ No newline at end of file
+    ret = _xpc_deserialize(buf, &off, len);
+    XPC_STATS_DESERIALIZE(off, start);
+    return ret;
+}
+
+size_t _xpc_serialized_skip(const uint8_t *buf, size_t off, size_t len) {
+    size_t tlen;
+    xpc_s_type_t type;
+    type = XPC_READ(xpc_s_type_t) >> 12;
+    switch (type) {
+        case XPC_BOOL:
+            return off + sizeof(uint32_t);
+        case XPC_INT64:
+        case XPC_UINT64:
+        case XPC_DOUBLE:
+            return off + sizeof(uint64_t);
+        case XPC_DATA:
+        case XPC_STRING:
+            tlen = XPC_READ(int32_t);
+            return off + XPC_DATA_PAD_SIZE(tlen);
+        case XPC_UUID:
+            return off + sizeof(unsigned char[16]);
+        case XPC_DICTIONARY:
+        case XPC_ARRAY:
+            // The size covers everything after the size field itself
+            tlen = XPC_READ(uint32_t);
+            return off + tlen;
+        default:
+            return off;
+    }
+}
+
+static uint64_t _xpc_hash_serialized(const uint8_t *buf, size_t *offp, size_t len) {
+    size_t tlen, off = *offp;
+    size_t r_size, r_cnt, cnt, m_len, key_size;
+    const char *key;
+    xpc_s_type_t type;
+    uint64_t h, v;
+    uint8_t b;
+    type = XPC_READ(xpc_s_type_t) >> 12;
+    switch (type) {
+        case XPC_BOOL:
+            b = XPC_READ(int32_t) ? 1 : 0;
+            h = _xpc_hash_leaf(XPC_BOOL, &b, sizeof(b));
+            break;
+        case XPC_INT64:
+        case XPC_UINT64:
+        case XPC_DOUBLE:
+            v = XPC_READ(uint64_t);
+            h = _xpc_hash_leaf(type, &v, sizeof(v));
+            break;
+        case XPC_DATA:
+        case XPC_STRING:
+            tlen = XPC_READ(int32_t);
+            if (off > len || tlen > len - off)
+                tlen = 0;
+            if (type == XPC_DATA)
+                h = _xpc_hash_leaf(XPC_DATA, &buf[off], tlen);
+            else
+                h = _xpc_hash_leaf(XPC_STRING, &buf[off], tlen > 0 ? tlen - 1 : 0);
+            off += XPC_DATA_PAD_SIZE(tlen);
+            break;
+        case XPC_UUID:
+            h = _xpc_hash_leaf(XPC_UUID, &buf[off], sizeof(unsigned char[16]));
+            off += sizeof(unsigned char[16]);
+            break;
+        case XPC_DICTIONARY:
+            r_size = XPC_READ(uint32_t);
+            m_len = off + r_size;
+            if (len > m_len)
+                len = m_len;
+            r_cnt = cnt = XPC_READ(uint32_t);
+            h = 0;
+            while (r_cnt-- && off < len) {
+                key = (const char *) &buf[off];
+                key_size = strnlen(key, len - off);
+                off += XPC_DATA_PAD_SIZE(key_size + 1);
+                h += _xpc_hash_dict_entry(key, key_size, _xpc_hash_serialized(buf, &off, len));
+            }
+            h = _xpc_hash_dict_finish(cnt, h);
+            break;
+        case XPC_ARRAY:
+            r_size = XPC_READ(uint32_t);
+            m_len = off + r_size;
+            if (len > m_len)
+                len = m_len;
+            r_cnt = XPC_READ(uint32_t);
+            h = _xpc_hash_array_begin(r_cnt);
+            while (r_cnt-- && off < len)
+                h = _xpc_hash_array_add(h, _xpc_hash_serialized(buf, &off, len));
+            break;
+        default:
+            h = _xpc_hash_leaf(type, NULL, 0);
+            break;
+    }
+    *offp = off;
+    return h;
+}
+
+bool xpc_hash_serialized(const uint8_t *buf, size_t len, uint64_t *hash) {
+    size_t off = 0;
+    uint32_t magic = XPC_READ(uint32_t);
+    uint32_t version = XPC_READ(uint32_t);
+    if (magic != XPC_BIN_MAGIC || version != XPC_BIN_VERSION)
+        return false;
+    *hash = _xpc_hash_serialized(buf, &off, len);
+    return true;
+}
@@ -0,0 +1,228 @@
+#include <xpc/xpc_serialization.h>
+#include "xpc_internal.h"
+#include <pthread.h>
+
+#define XPC_PARALLEL_MAX_THREADS 64
+// Containers are only split if every thread gets at least this many top level elements
+#define XPC_PARALLEL_MIN_CHUNK 256
+
+struct xpc_parallel_job;
+
+struct xpc_parallel_worker {
+    struct xpc_parallel_job *job;
+    pthread_t thread;
+    bool started;
+    size_t begin, end;
+    size_t off; /* offset of the first element, and the serialized size of the range once it has been sized */
+};
+
+struct xpc_parallel_job {
+    xpc_object_t obj;
+    uint8_t *out;
+    const uint8_t *in;
+    size_t len;
+    const char **keys;
+    xpc_object_t *values;
+    unsigned int nthreads;
+    struct xpc_parallel_worker workers[XPC_PARALLEL_MAX_THREADS];
+};
+
+static unsigned int _xpc_parallel_thread_count(size_t count, unsigned int nthreads) {
+    if (nthreads > XPC_PARALLEL_MAX_THREADS)
+        nthreads = XPC_PARALLEL_MAX_THREADS;
+    if (nthreads > count / XPC_PARALLEL_MIN_CHUNK)
+        nthreads = (unsigned int) (count / XPC_PARALLEL_MIN_CHUNK);
+    return nthreads;
+}
+
+static void _xpc_parallel_split(struct xpc_parallel_job *job, size_t count) {
+    unsigned int i;
+    for (i = 0; i < job->nthreads; i++) {
+        job->workers[i].job = job;
+        job->workers[i].begin = count * i / job->nthreads;
+        job->workers[i].end = count * (i + 1) / job->nthreads;
+    }
+}
+
+/* Runs fn for every worker, the first one on the calling thread. Workers whose thread can't be created run on the
+ * calling thread as well, so a job always completes. */
+static void _xpc_parallel_run(struct xpc_parallel_job *job, void *(*fn)(void *)) {
+    unsigned int i;
+    for (i = 1; i < job->nthreads; i++)
+        job->workers[i].started = pthread_create(&job->workers[i].thread, NULL, fn, &job->workers[i]) == 0;
+    fn(&job->workers[0]);
+    for (i = 1; i < job->nthreads; i++) {
+        if (job->workers[i].started)
+            pthread_join(job->workers[i].thread, NULL);
+        else
+            fn(&job->workers[i]);
+    }
+}
+
+static void *_xpc_parallel_size_worker(void *arg) {
+    struct xpc_parallel_worker *w = (struct xpc_parallel_worker *) arg;
+    struct xpc_value *v = (struct xpc_value *) w->job->obj;
+    struct xpc_dict_entry *e;
+    size_t i, ret = 0;
+    if (v->type == XPC_ARRAY) {
+        for (i = w->begin; i < w->end; ++i)
+            ret += _xpc_serialized_size(((struct xpc_array *) v)->value[i]);
+    } else {
+        for (i = w->begin; i < w->end; ++i) {
+            e = &((struct xpc_dict *) v)->entries[i];
+            if (!e->value)
+                continue;
+            ret += XPC_DATA_PAD_SIZE(e->key_length + 1);
+            ret += _xpc_serialized_size(e->value);
+        }
+    }
+    w->off = ret;
+    return NULL;
+}
+
+static void *_xpc_parallel_serialize_worker(void *arg) {
+    struct xpc_parallel_worker *w = (struct xpc_parallel_worker *) arg;
+    struct xpc_value *v = (struct xpc_value *) w->job->obj;
+    uint8_t *buf = w->job->out + w->off;
+    struct xpc_dict_entry *e;
+    size_t i;
+    if (v->type == XPC_ARRAY) {
+        for (i = w->begin; i < w->end; ++i)
+            buf += _xpc_serialize(((struct xpc_array *) v)->value[i], buf, 0);
+    } else {
+        for (i = w->begin; i < w->end; ++i) {
+            e = &((struct xpc_dict *) v)->entries[i];
+            if (!e->value)
+                continue;
+            XPC_COPY_PADDED(e->key, e->key_length + 1)
+            buf += _xpc_serialize(e->value, buf, 0);
+        }
+    }
+    return NULL;
+}
+
+size_t xpc_serialize_parallel(xpc_object_t o, uint8_t *buf, unsigned int nthreads) {
+    XPC_STATS_TIME_BEGIN(start);
+    struct xpc_value *v = (struct xpc_value *) o;
+    struct xpc_parallel_job job;
+    uint8_t *const buf_i = buf;
+    uint32_t *size_ptr;
+    size_t i, count, size, part;
+    if (v->type == XPC_ARRAY)
+        count = ((struct xpc_array *) o)->count;
+    else if (v->type == XPC_DICTIONARY)
+        count = ((struct xpc_dict *) o)->used;
+    else
+        return xpc_serialize(o, buf);
+    nthreads = _xpc_parallel_thread_count(count, nthreads);
+    if (nthreads <= 1)
+        return xpc_serialize(o, buf);
+
+    XPC_WRITE(uint32_t, XPC_BIN_MAGIC)
+    XPC_WRITE(uint32_t, XPC_BIN_VERSION)
+    XPC_WRITE(xpc_s_type_t, XPC_SERIALIZED_TYPE(v->type))
+    size_ptr = (uint32_t *) buf;
+    XPC_WRITE(uint32_t, 0)
+    XPC_WRITE(uint32_t, v->type == XPC_ARRAY ? count : ((struct xpc_dict *) o)->count)
+
+    memset(&job, 0, sizeof(job));
+    job.obj = o;
+    job.out = buf;
+    job.nthreads = nthreads;
+    _xpc_parallel_split(&job, count);
+    _xpc_parallel_run(&job, _xpc_parallel_size_worker);
+    for (i = 0, size = 0; i < nthreads; i++) {
+        part = job.workers[i].off;
+        job.workers[i].off = size;
+        size += part;
+    }
+    _xpc_parallel_run(&job, _xpc_parallel_serialize_worker);
+
+    buf += size;
+    *size_ptr = buf - (uint8_t *) (size_ptr + 1);
+    XPC_STATS_SERIALIZE(buf - buf_i, start);
+    return buf - buf_i;
+}
+
+static void *_xpc_parallel_deserialize_worker(void *arg) {
+    struct xpc_parallel_worker *w = (struct xpc_parallel_worker *) arg;
+    struct xpc_parallel_job *job = w->job;
+    size_t i, off = w->off;
+    if (job->obj) {
+        for (i = w->begin; i < w->end; ++i)
+            ((struct xpc_array *) job->obj)->value[i] = _xpc_deserialize(job->in, &off, job->len);
+    } else {
+        for (i = w->begin; i < w->end; ++i) {
+            job->keys[i] = (const char *) &job->in[off];
+            off += XPC_DATA_PAD_SIZE(strnlen(job->keys[i], job->len - off) + 1);
+            job->values[i] = _xpc_deserialize(job->in, &off, job->len);
+        }
+    }
+    return NULL;
+}
+
+/* Finds where each worker's range starts. Fails if the container runs past the end of the buffer, in which case the
+ * serial path is left to deal with the truncated input. */
+static bool _xpc_parallel_scan(struct xpc_parallel_job *job, size_t off, size_t count, bool dict) {
+    const uint8_t *buf = job->in;
+    size_t i;
+    unsigned int w = 0;
+    for (i = 0; i < count; ++i) {
+        if (w < job->nthreads && job->workers[w].begin == i)
+            job->workers[w++].off = off;
+        if (dict && off < job->len)
+            off += XPC_DATA_PAD_SIZE(strnlen((const char *) &buf[off], job->len - off) + 1);
+        if (off >= job->len)
+            return false;
+        off = _xpc_serialized_skip(buf, off, job->len);
+        if (off > job->len)
+            return false;
+    }
+    return true;
+}
+
+xpc_object_t xpc_deserialize_parallel(const uint8_t *buf, size_t len, unsigned int nthreads) {
+    XPC_STATS_TIME_BEGIN(start);
+    struct xpc_parallel_job job;
+    size_t off = 0, size, count, i;
+    uint32_t magic = XPC_READ(uint32_t);
+    uint32_t version = XPC_READ(uint32_t);
+    xpc_s_type_t type = XPC_READ(xpc_s_type_t) >> 12;
+    xpc_object_t ret;
+    if (magic != XPC_BIN_MAGIC || version != XPC_BIN_VERSION || (type != XPC_ARRAY && type != XPC_DICTIONARY))
+        return xpc_deserialize(buf, len);
+    size = XPC_READ(uint32_t);
+    count = XPC_READ(uint32_t);
+    if (off > len)
+        return xpc_deserialize(buf, len);
+    nthreads = _xpc_parallel_thread_count(count, nthreads);
+    if (nthreads <= 1)
+        return xpc_deserialize(buf, len);
+
+    memset(&job, 0, sizeof(job));
+    job.in = buf;
+    job.len = len > off - sizeof(uint32_t) + size ? off - sizeof(uint32_t) + size : len;
+    job.nthreads = nthreads;
+    _xpc_parallel_split(&job, count);
+    if (!_xpc_parallel_scan(&job, off, count, type == XPC_DICTIONARY))
+        return xpc_deserialize(buf, len);
+
+    if (type == XPC_ARRAY) {
+        ret = job.obj = xpc_array_create_preallocated(count);
+        _xpc_parallel_run(&job, _xpc_parallel_deserialize_worker);
+        ((struct xpc_array *) ret)->count = count;
+    } else {
+        job.keys = _xpc_mem_alloc(count * sizeof(const char *));
+        job.values = _xpc_mem_alloc(count * sizeof(xpc_object_t));
+        _xpc_parallel_run(&job, _xpc_parallel_deserialize_worker);
+        // Inserting stays serial, it's cheap next to building the values
+        ret = xpc_dictionary_create(NULL, NULL, 0);
+        _xpc_dictionary_reserve(ret, count);
+        for (i = 0; i < count; ++i)
+            xpc_dictionary_set_value(ret, job.keys[i], job.values[i]);
+        _xpc_mem_free(job.keys);
+        _xpc_mem_free(job.values);
+    }
+    XPC_STATS_DESERIALIZE(job.len, start);
+    return ret;
+}
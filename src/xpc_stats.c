@@ -0,0 +1,154 @@
+#include <xpc/xpc_stats.h>
+#include "xpc_internal.h"
+
+#ifdef XPC_ENABLE_STATS
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Every thread owns a block of counters which only it writes to, readers merge all blocks under the lock. All fields
+ * are uint64_t so blocks can be merged word by word. */
+struct xpc_stats_counters {
+    uint64_t alloc_count[XPC_STATS_MAX_TYPE], free_count[XPC_STATS_MAX_TYPE];
+    uint64_t alloc_bytes[XPC_STATS_MAX_TYPE], free_bytes[XPC_STATS_MAX_TYPE];
+    struct xpc_stats_op serialize, deserialize;
+    uint64_t dict_probe_histogram[XPC_STATS_PROBE_HISTOGRAM_SIZE];
+};
+struct xpc_stats_block {
+    struct xpc_stats_counters counters;
+    struct xpc_stats_block *prev, *next;
+};
+
+static pthread_mutex_t _xpc_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _xpc_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _xpc_stats_key;
+static struct xpc_stats_block *_xpc_stats_blocks;
+static struct xpc_stats_counters _xpc_stats_retired;
+static __thread struct xpc_stats_block *_xpc_stats_local_block;
+
+static void _xpc_stats_merge(struct xpc_stats_counters *dst, struct xpc_stats_counters *src) {
+    uint64_t *d = (uint64_t *) dst, *s = (uint64_t *) src;
+    size_t i;
+    for (i = 0; i < sizeof(struct xpc_stats_counters) / sizeof(uint64_t); i++)
+        d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+static void _xpc_stats_thread_exit(void *ptr) {
+    struct xpc_stats_block *block = (struct xpc_stats_block *) ptr;
+    pthread_mutex_lock(&_xpc_stats_lock);
+    _xpc_stats_merge(&_xpc_stats_retired, &block->counters);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        _xpc_stats_blocks = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    pthread_mutex_unlock(&_xpc_stats_lock);
+    free(block);
+    // Objects freed by later destructors on this thread get a fresh block, which the key's next pass retires
+    _xpc_stats_local_block = NULL;
+}
+
+static void _xpc_stats_init(void) {
+    pthread_key_create(&_xpc_stats_key, _xpc_stats_thread_exit);
+}
+
+static struct xpc_stats_counters *_xpc_stats_local(void) {
+    struct xpc_stats_block *block = _xpc_stats_local_block;
+    if (block)
+        return &block->counters;
+    // Allocated with libc, the blocks outlive any allocator set with xpc_set_allocator
+    pthread_once(&_xpc_stats_once, _xpc_stats_init);
+    block = calloc(1, sizeof(struct xpc_stats_block));
+    pthread_mutex_lock(&_xpc_stats_lock);
+    block->next = _xpc_stats_blocks;
+    if (block->next)
+        block->next->prev = block;
+    _xpc_stats_blocks = block;
+    pthread_mutex_unlock(&_xpc_stats_lock);
+    pthread_setspecific(_xpc_stats_key, block);
+    _xpc_stats_local_block = block;
+    return &block->counters;
+}
+
+static inline void _xpc_stats_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline size_t _xpc_stats_histogram_bucket(uint64_t value) {
+    size_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+    return bucket < XPC_STATS_HISTOGRAM_SIZE ? bucket : XPC_STATS_HISTOGRAM_SIZE - 1;
+}
+
+void _xpc_stats_object(xpc_type_t type, size_t bytes, bool alloc) {
+    struct xpc_stats_counters *c = _xpc_stats_local();
+    _xpc_stats_add(alloc ? &c->alloc_count[type] : &c->free_count[type], 1);
+    _xpc_stats_add(alloc ? &c->alloc_bytes[type] : &c->free_bytes[type], bytes);
+}
+
+void _xpc_stats_bytes(xpc_type_t type, size_t bytes, bool alloc) {
+    struct xpc_stats_counters *c = _xpc_stats_local();
+    _xpc_stats_add(alloc ? &c->alloc_bytes[type] : &c->free_bytes[type], bytes);
+}
+
+void _xpc_stats_dict_probe(size_t probes) {
+    struct xpc_stats_counters *c = _xpc_stats_local();
+    if (probes >= XPC_STATS_PROBE_HISTOGRAM_SIZE)
+        probes = XPC_STATS_PROBE_HISTOGRAM_SIZE - 1;
+    _xpc_stats_add(&c->dict_probe_histogram[probes], 1);
+}
+
+uint64_t _xpc_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void _xpc_stats_op(struct xpc_stats_op *op, size_t bytes, uint64_t start) {
+    uint64_t time = _xpc_stats_now() - start;
+    _xpc_stats_add(&op->count, 1);
+    _xpc_stats_add(&op->bytes, bytes);
+    _xpc_stats_add(&op->time_ns, time);
+    _xpc_stats_add(&op->size_histogram[_xpc_stats_histogram_bucket(bytes)], 1);
+    _xpc_stats_add(&op->time_histogram[_xpc_stats_histogram_bucket(time)], 1);
+}
+
+void _xpc_stats_serialize(size_t bytes, uint64_t start) {
+    _xpc_stats_op(&_xpc_stats_local()->serialize, bytes, start);
+}
+
+void _xpc_stats_deserialize(size_t bytes, uint64_t start) {
+    _xpc_stats_op(&_xpc_stats_local()->deserialize, bytes, start);
+}
+
+bool xpc_stats_snapshot(struct xpc_stats *stats) {
+    struct xpc_stats_counters sum;
+    struct xpc_stats_block *block;
+    size_t i;
+    pthread_mutex_lock(&_xpc_stats_lock);
+    sum = _xpc_stats_retired;
+    for (block = _xpc_stats_blocks; block; block = block->next)
+        _xpc_stats_merge(&sum, &block->counters);
+    pthread_mutex_unlock(&_xpc_stats_lock);
+
+    for (i = 0; i < XPC_STATS_MAX_TYPE; i++) {
+        stats->types[i].total_count = sum.alloc_count[i];
+        stats->types[i].live_count = sum.alloc_count[i] - sum.free_count[i];
+        stats->types[i].total_bytes = sum.alloc_bytes[i];
+        stats->types[i].live_bytes = sum.alloc_bytes[i] - sum.free_bytes[i];
+    }
+    stats->serialize = sum.serialize;
+    stats->deserialize = sum.deserialize;
+    memcpy(stats->dict_probe_histogram, sum.dict_probe_histogram, sizeof(stats->dict_probe_histogram));
+    return true;
+}
+
+#else
+
+bool xpc_stats_snapshot(struct xpc_stats *stats) {
+    memset(stats, 0, sizeof(struct xpc_stats));
+    return false;
+}
+
+#endif